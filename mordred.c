@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE_EXTENDED 1
 #include <ncurses.h>
 #include <dirent.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -9,6 +12,34 @@
 #include <stdio.h>
 #include <locale.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <zlib.h>
+#include <signal.h>
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#else
+#include <sys/event.h>
+#endif
+#if defined(__APPLE__)
+#include <copyfile.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define UPPER_RIGHT_CORNER         ACS_URCORNER
 #define LOWER_RIGHT_CORNER         ACS_LRCORNER
@@ -24,17 +55,49 @@
 #define K_ENTER     10
 #define K_BACKSPACE 127
 
-char *TEXT_FILE_EXTENSIONS[] = {".txt", ".py", ".c", ".java"};
+#define SESSION_MAGIC   "MRDS"
+#define SESSION_VERSION 2
+
+// a point where a name can be cut without splitting a character or
+// separating a combining mark from its base
+struct cut
+{
+    int chars;
+    int width;
+};
+
+struct entry
+{
+    char *name;
+    wchar_t *wname;     // NULL when the name is plain printable ASCII
+    int width;          // display columns
+    int n_cuts;
+    struct cut *cuts;
+    int group;          // duplicate set the entry belongs to
+    int file_class;     // CLASS_UNKNOWN until the entry is drawn
+    bool marked;
+    int diff;           // DIFF_* in comparison blocks
+    int git_status;     // GIT_UNKNOWN until the entry is drawn
+};
+
+struct tar_index;
 
 struct dirblock
 {
     char *path;
     char *selected;
-    char **files;
+    struct entry *files;
     int column;
     int n_files;
     int selected_index;
     int column_size;
+    int offset;         // first visible row, kept between frames
+    int64_t mtime;      // directory mtime (ns) at the time of the scan
+    struct tar_index *archive;  // set for blocks listing a directory of a tar
+    int archive_dir;
+    bool duplicates;            // entries are paths below path, in duplicate sets
+    bool comparison;            // entries are paths below path, one side of a compare
+    unsigned long git_generation;   // repository state the git status of the entries was read from
 };
 
 struct window
@@ -49,19 +112,21 @@ struct window
     int block_quantity;
     char *path;
     bool moving_file;
+    bool revalidating;
+    char *compare_source;       // directory picked with c, waiting for the other one
 };
 
 struct window wd;
 
-static int compare_strings(const void *a, const void *b) {
-    return strcmp(*(const char**)a, *(const char**)b);
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct entry *)a)->name, ((const struct entry *)b)->name);
 }
 
-static void sort_files(char **files, int n_files) {
+static void sort_files(struct entry *files, int n_files) {
     if (!files) return;
     
     if (n_files > 0) {
-        qsort(files, (size_t) n_files, sizeof(char*), compare_strings);
+        qsort(files, (size_t) n_files, sizeof(struct entry), compare_entries);
     }
 }
 
@@ -79,41 +144,43 @@ int get_column_by_index(int i) {
 
 }
 
-void get_type_and_permissions(char *buffer, const char *path) {
-    struct stat st;
-    if (buffer && stat(path, &st) == 0) {
-        mode_t perm = st.st_mode;
-
-        if (S_ISREG(st.st_mode)) {
-            buffer[0] = 'r';
-        } else if (S_ISDIR(st.st_mode)) {
-            buffer[0] = 'd';
-        } else if (S_ISLNK(st.st_mode)) {
-            buffer[0] = 'l';
-        } else if (S_ISCHR(st.st_mode)) {
-            buffer[0] = 'c';
-        } else if (S_ISBLK(st.st_mode)) {
-            buffer[0] = 'b';
-        } else if (S_ISFIFO(st.st_mode)) {
-            buffer[0] = 'f';
-        } else if (S_ISSOCK(st.st_mode)) {
-            buffer[0] = 's';
-        } else {
-            buffer[0] = '#'; //unkown type
-        }
+void format_type_and_permissions(char *buffer, mode_t perm) {
+    if (S_ISREG(perm)) {
+        buffer[0] = 'r';
+    } else if (S_ISDIR(perm)) {
+        buffer[0] = 'd';
+    } else if (S_ISLNK(perm)) {
+        buffer[0] = 'l';
+    } else if (S_ISCHR(perm)) {
+        buffer[0] = 'c';
+    } else if (S_ISBLK(perm)) {
+        buffer[0] = 'b';
+    } else if (S_ISFIFO(perm)) {
+        buffer[0] = 'f';
+    } else if (S_ISSOCK(perm)) {
+        buffer[0] = 's';
+    } else {
+        buffer[0] = '#'; //unkown type
+    }
 
-        buffer[1] = (perm & S_IRUSR) ? 'r' : '-',
-        buffer[2] = (perm & S_IWUSR) ? 'w' : '-',
-        buffer[3] = (perm & S_IXUSR) ? 'x' : '-';
+    buffer[1] = (perm & S_IRUSR) ? 'r' : '-',
+    buffer[2] = (perm & S_IWUSR) ? 'w' : '-',
+    buffer[3] = (perm & S_IXUSR) ? 'x' : '-';
 
-        buffer[4] = (perm & S_IRGRP) ? 'r' : '-',
-        buffer[5] = (perm & S_IWGRP) ? 'w' : '-',
-        buffer[6] = (perm & S_IXGRP) ? 'x' : '-';
+    buffer[4] = (perm & S_IRGRP) ? 'r' : '-',
+    buffer[5] = (perm & S_IWGRP) ? 'w' : '-',
+    buffer[6] = (perm & S_IXGRP) ? 'x' : '-';
 
-        buffer[7] = (perm & S_IROTH) ? 'r' : '-',
-        buffer[8] = (perm & S_IWOTH) ? 'w' : '-',
-        buffer[9] = (perm & S_IXOTH) ? 'x' : '-';
-        buffer[10] = '\0';
+    buffer[7] = (perm & S_IROTH) ? 'r' : '-',
+    buffer[8] = (perm & S_IWOTH) ? 'w' : '-',
+    buffer[9] = (perm & S_IXOTH) ? 'x' : '-';
+    buffer[10] = '\0';
+}
+
+void get_type_and_permissions(char *buffer, const char *path) {
+    struct stat st;
+    if (buffer && stat(path, &st) == 0) {
+        format_type_and_permissions(buffer, st.st_mode);
     } else {
         strncpy(buffer, "unkown", 10); // 9 because there are 9 possible permission bits
         buffer[10] = '\0';
@@ -145,28 +212,127 @@ bool equal_strings(const char *a, const char *b) {
     return strcmp(a, b) == 0 ? 1 : 0;
 }
 
-int get_number_of_files(const char *path) {
-    DIR *dir = opendir(path);
-    struct dirent *entry;
-    int quantity = 0;
-    while ((entry = readdir(dir)) != NULL)
-    {
-        if (equal_strings(entry->d_name, ".") || equal_strings(entry->d_name, ".."))
-        {
-            continue;
+bool is_plain_ascii(const char *name) {
+    for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+        if (*c < 0x20 || *c > 0x7e) {
+            return false;
         }
-        quantity++;
     }
+    return true;
+}
 
-    closedir(dir);
-    return quantity;
+// Decodes the name once so rendering never has to measure it again.
+// Undecodable bytes and control characters are shown as '?'.
+struct entry make_entry(char *name) {
+    struct entry e = {name, NULL, 0, 0, NULL};
+    size_t len = strlen(name);
+
+    if (is_plain_ascii(name)) {
+        e.width = len;
+        return e;
+    }
+
+    e.wname = malloc(sizeof(wchar_t) * (len + 1));
+    e.cuts = malloc(sizeof(struct cut) * (len + 1));
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    const char *p = name;
+    size_t left = len;
+    int chars = 0;
+
+    while (left > 0) {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, p, left, &state);
+        if (n == (size_t) -1 || n == (size_t) -2 || n == 0) {
+            memset(&state, 0, sizeof(state));
+            wc = L'?';
+            n = 1;
+        }
+        int w = wcwidth(wc);
+        if (w < 0) {
+            wc = L'?';
+            w = 1;
+        }
+        if (w > 0) {
+            e.cuts[e.n_cuts++] = (struct cut){chars, e.width};
+        }
+        e.wname[chars++] = wc;
+        e.width += w;
+        p += n;
+        left -= n;
+    }
+    e.wname[chars] = L'\0';
+    e.cuts[e.n_cuts++] = (struct cut){chars, e.width};
+    return e;
+}
+
+void free_entry(struct entry *e) {
+    free(e->name);
+    free(e->wname);
+    free(e->cuts);
+}
+
+void free_files(struct entry *files, int n_files) {
+    for (int i = 0; i < n_files; i++) {
+        free_entry(&files[i]);
+    }
+    free(files);
+}
+
+// number of characters of the entry that fit in width columns
+int get_entry_cut(const struct entry *e, int width) {
+    if (!e->wname) {
+        return width < e->width ? width : e->width;
+    }
+
+    int lo = 0, hi = e->n_cuts - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (e->cuts[mid].width <= width) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return e->cuts[lo].chars;
+}
+
+int get_entry_cut_width(const struct entry *e, int width) {
+    if (!e->wname) {
+        return width < e->width ? width : e->width;
+    }
+
+    int chars = get_entry_cut(e, width);
+    for (int i = e->n_cuts - 1; i >= 0; i--) {
+        if (e->cuts[i].chars == chars) {
+            return e->cuts[i].width;
+        }
+    }
+    return 0;
 }
 
-void get_files(const char *path, char **files) {
-    int fileslen = get_number_of_files(path);
+// bounds for background scans: they give up past max_files entries or
+// max_bytes of names, or as soon as *generation moves away from expected
+struct scan_limits
+{
+    int max_files;
+    size_t max_bytes;
+    unsigned long *generation;
+    unsigned long expected;
+};
+
+// Reads the directory in a single pass, growing the array as needed.
+// Returns NULL only when limits are given and hit.
+struct entry *get_files_limited(const char *path, int *n_files, struct scan_limits *limits) {
     DIR *dir = opendir(path);
     struct dirent *entry;
-    int i = 0;
+    int capacity = 64;
+    size_t bytes = 0;
+    struct entry *files = malloc(sizeof(struct entry) * capacity);
+    *n_files = 0;
+    if (!dir) {
+        return files;
+    }
 
     while ((entry = readdir(dir)) != NULL)
     {
@@ -174,42 +340,543 @@ void get_files(const char *path, char **files) {
         {
             continue;
         }
-        files[i++] = strdup(entry->d_name);
+        if (limits) {
+            bytes += sizeof(struct entry) + strlen(entry->d_name) + 1;
+            if (*n_files >= limits->max_files || bytes > limits->max_bytes ||
+                __atomic_load_n(limits->generation, __ATOMIC_RELAXED) != limits->expected) {
+                closedir(dir);
+                free_files(files, *n_files);
+                return NULL;
+            }
+        }
+        if (*n_files == capacity) {
+            capacity *= 2;
+            files = realloc(files, sizeof(struct entry) * capacity);
+        }
+        files[(*n_files)++] = make_entry(strdup(entry->d_name));
     }
 
     closedir(dir);
+    return files;
 }
 
-int get_size_longest_name(const char *path) {
-    DIR *dir = opendir(path);
-    struct dirent *entry;
+struct entry *get_files(const char *path, int *n_files) {
+    return get_files_limited(path, n_files, NULL);
+}
+
+int get_size_longest_name(const struct entry *files, int n_files) {
     int longest = 0;
-    while ((entry = readdir(dir)) != NULL)
-    {
-        if (strlen(entry->d_name) > longest)
-        {
-            longest = strlen(entry->d_name);
+    for (int i = 0; i < n_files; i++) {
+        if (files[i].width > longest) {
+            longest = files[i].width;
         }
     }
-
-    closedir(dir);
     return longest;
 }
 
-int get_column_size(const char *path) {
-    return SPACES_AFTER_LEFT_BORDER + get_size_longest_name(path) + SPACES_BEFORE_RIGHT_BORDER;
+int get_column_size(const struct entry *files, int n_files) {
+    return SPACES_AFTER_LEFT_BORDER + get_size_longest_name(files, n_files) + SPACES_BEFORE_RIGHT_BORDER;
+}
+
+int64_t get_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+int64_t get_dir_mtime(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    return get_mtime_ns(&st);
 }
 
 struct dirblock get_dirblock(char *path, int column) {
-    int fileslen = get_number_of_files(path);
-    char **files = malloc(sizeof(char *) * fileslen);
-    get_files(path, files);
+    // taken before the scan so a change racing with it is seen next time
+    int64_t mtime = get_dir_mtime(path);
+    int fileslen;
+    struct entry *files = get_files(path, &fileslen);
     sort_files(files, fileslen);
-    char *selected = files[0];
+    char *selected = fileslen > 0 ? files[0].name : NULL;
     int selected_index = 0;
-    int column_size = get_column_size(path);
+    int column_size = get_column_size(files, fileslen);
+
+    return (struct dirblock){path, selected, files, column, fileslen, selected_index, column_size, 0, mtime, NULL, 0};
+}
+
+// drops an entry from a virtual block, and with it the rest of its
+// duplicate set when only one file is left
+void remove_block_entry(struct dirblock *block, int index) {
+    int group = block->files[index].group;
+    free_entry(&block->files[index]);
+    memmove(&block->files[index], &block->files[index + 1], sizeof(struct entry) * (block->n_files - index - 1));
+    block->n_files--;
+
+    if (block->duplicates) {
+        int members = 0, last = -1;
+        for (int i = 0; i < block->n_files; i++) {
+            if (block->files[i].group == group) {
+                members++;
+                last = i;
+            }
+        }
+        if (members == 1) {
+            remove_block_entry(block, last);
+            if (last < index) {
+                index--;
+            }
+        }
+    }
+
+    if (index >= block->n_files) {
+        index = block->n_files - 1;
+    }
+    block->selected_index = index < 0 ? 0 : index;
+    block->selected = block->n_files > 0 ? block->files[block->selected_index].name : NULL;
+}
+
+// Tar archives are browsed in place: one pass over the headers builds a
+// tree of members, and members are read straight from the archive by
+// offset. Indexes are cached by the archive's dev/inode/mtime and freed
+// once stale and no longer used by a block or a pending copy.
+
+#define TAR_BLOCK 512
+
+struct tar_member
+{
+    char *name;             // last path component
+    off_t data_offset;
+    off_t size;
+    mode_t mode;            // type and permission bits
+    int64_t mtime;
+    int parent;
+    int first_child;
+    int next_sibling;
+};
+
+struct tar_index
+{
+    char *archive;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    struct tar_member *members; // members[0] is the root directory
+    int n_members;
+    int members_capacity;
+    int *slots;                 // (parent, name) hash table of member indexes
+    int n_slots;
+    int refs;                   // archive blocks and pending copies, plus one while cached
+    struct tar_index *next;
+};
+
+struct tar_index *tar_cache = NULL;
+
+static uint32_t hash_name(int parent, const char *name) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+        h = (h ^ *c) * 16777619u;
+    }
+    return h;
+}
+
+// index of the child of parent called name, or -1
+int tar_lookup(struct tar_index *tar, int parent, const char *name) {
+    if (name == NULL) {
+        return -1;
+    }
+    uint32_t mask = tar->n_slots - 1;
+    for (uint32_t i = hash_name(parent, name) & mask; tar->slots[i] >= 0; i = (i + 1) & mask) {
+        struct tar_member *m = &tar->members[tar->slots[i]];
+        if (m->parent == parent && equal_strings(m->name, name)) {
+            return tar->slots[i];
+        }
+    }
+    return -1;
+}
+
+static void tar_insert_slot(struct tar_index *tar, int member) {
+    uint32_t mask = tar->n_slots - 1;
+    struct tar_member *m = &tar->members[member];
+    uint32_t i = hash_name(m->parent, m->name) & mask;
+    while (tar->slots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    tar->slots[i] = member;
+}
+
+static int tar_add_member(struct tar_index *tar, int parent, const char *name, mode_t mode) {
+    if ((tar->n_members + 1) * 2 > tar->n_slots) {
+        free(tar->slots);
+        tar->n_slots *= 2;
+        tar->slots = malloc(sizeof(int) * tar->n_slots);
+        memset(tar->slots, -1, sizeof(int) * tar->n_slots);
+        for (int i = 1; i < tar->n_members; i++) {
+            tar_insert_slot(tar, i);
+        }
+    }
+
+    if (tar->n_members == tar->members_capacity) {
+        tar->members_capacity *= 2;
+        tar->members = realloc(tar->members, sizeof(struct tar_member) * tar->members_capacity);
+    }
+    int index = tar->n_members++;
+    tar->members[index] = (struct tar_member){strdup(name), 0, 0, mode, 0, parent,
+                                              -1, tar->members[parent].first_child};
+    tar->members[parent].first_child = index;
+    tar_insert_slot(tar, index);
+    return index;
+}
+
+// finds or creates every directory of path, returning the last component's member
+static int tar_add_path(struct tar_index *tar, char *path, mode_t mode) {
+    int parent = 0;
+    char *save = NULL;
+    char *next;
+    char *part = strtok_r(path, "/", &save);
+
+    while (part) {
+        next = strtok_r(NULL, "/", &save);
+        if (equal_strings(part, ".")) {
+            part = next;
+            continue;
+        }
+        int index = tar_lookup(tar, parent, part);
+        if (index < 0) {
+            index = tar_add_member(tar, parent, part, next ? S_IFDIR | 0755 : mode);
+        } else if (!next) {
+            tar->members[index].mode = mode;
+        }
+        if (!next) {
+            return index;
+        }
+        parent = index;
+        part = next;
+    }
+    return -1;
+}
+
+// member at path, -1 when the archive has none
+static int tar_find_path(struct tar_index *tar, const char *path) {
+    char *copy = strdup(path);
+    char *save = NULL;
+    int index = 0;
+
+    for (char *part = strtok_r(copy, "/", &save); part && index >= 0; part = strtok_r(NULL, "/", &save)) {
+        if (!equal_strings(part, ".")) {
+            index = tar_lookup(tar, index, part);
+        }
+    }
+    free(copy);
+    return index;
+}
+
+static uint64_t tar_number(const char *field, int len) {
+    uint64_t value = 0;
+    // base-256 is used by GNU tar for values that do not fit in octal
+    if ((unsigned char) field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (int i = 1; i < len; i++) {
+            value = value << 8 | (unsigned char) field[i];
+        }
+        return value;
+    }
+    for (int i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static bool tar_checksum_ok(const unsigned char *header) {
+    uint64_t expected = tar_number((const char *) header + 148, 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    return sum == expected;
+}
+
+static bool read_exact(int fd, void *buffer, size_t len, off_t offset) {
+    return pread(fd, buffer, len, offset) == (ssize_t) len;
+}
+
+// applies the "path", "linkpath" and "size" records of a pax extended header
+static void tar_parse_pax(char *data, size_t len, char **path, char **link, off_t *size) {
+    size_t i = 0;
+    while (i < len) {
+        char *record = data + i;
+        size_t record_len = strtoul(record, NULL, 10);
+        char *key = strchr(record, ' ');
+        if (record_len == 0 || key == NULL || i + record_len > len) {
+            return;
+        }
+        key++;
+        char *value = strchr(key, '=');
+        if (value && value < data + i + record_len) {
+            size_t value_len = (data + i + record_len - 1) - (value + 1);
+            if (strncmp(key, "path=", 5) == 0) {
+                free(*path);
+                *path = strndup(value + 1, value_len);
+            } else if (strncmp(key, "linkpath=", 9) == 0) {
+                free(*link);
+                *link = strndup(value + 1, value_len);
+            } else if (strncmp(key, "size=", 5) == 0) {
+                *size = strtoll(value + 1, NULL, 10);
+            }
+        }
+        i += record_len;
+    }
+}
+
+void free_tar_index(struct tar_index *tar) {
+    for (int i = 0; i < tar->n_members; i++) {
+        free(tar->members[i].name);
+    }
+    free(tar->members);
+    free(tar->slots);
+    free(tar->archive);
+    free(tar);
+}
+
+void release_tar_index(struct tar_index *tar) {
+    if (--tar->refs == 0) {
+        free_tar_index(tar);
+    }
+}
+
+struct tar_index *build_tar_index(const char *archive, const struct stat *st) {
+    int fd = open(archive, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct tar_index *tar = calloc(1, sizeof(struct tar_index));
+    tar->archive = strdup(archive);
+    tar->dev = st->st_dev;
+    tar->ino = st->st_ino;
+    tar->mtime = get_mtime_ns(st);
+    tar->n_slots = 64;
+    tar->slots = malloc(sizeof(int) * tar->n_slots);
+    memset(tar->slots, -1, sizeof(int) * tar->n_slots);
+    tar->members_capacity = 64;
+    tar->members = malloc(sizeof(struct tar_member) * tar->members_capacity);
+    tar->members[0] = (struct tar_member){strdup(""), 0, 0, S_IFDIR | 0755, 0, -1, -1, -1};
+    tar->n_members = 1;
+
+    unsigned char header[TAR_BLOCK];
+    char *long_name = NULL;
+    char *long_link = NULL;
+    off_t pax_size = -1;
+    off_t offset = 0;
+
+    while (read_exact(fd, header, TAR_BLOCK, offset)) {
+        if (header[0] == '\0') {
+            break; // end of archive marker
+        }
+        if (!tar_checksum_ok(header)) {
+            if (offset == 0) {
+                close(fd);
+                free_tar_index(tar);
+                return NULL;
+            }
+            break;
+        }
+
+        char type = header[156];
+        off_t size = tar_number((char *) header + 124, 12);
+        off_t data_offset = offset + TAR_BLOCK;
+        offset = data_offset + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+        if (type == 'L' || type == 'K' || type == 'x') {
+            char *data = malloc(size + 1);
+            if (!read_exact(fd, data, size, data_offset)) {
+                free(data);
+                break;
+            }
+            data[size] = '\0';
+            if (type == 'L') {
+                free(long_name);
+                long_name = data;
+            } else if (type == 'K') {
+                free(long_link);
+                long_link = data;
+            } else {
+                tar_parse_pax(data, size, &long_name, &long_link, &pax_size);
+                free(data);
+            }
+            continue;
+        } else if (type == 'g') {
+            continue;
+        }
+
+        char *path;
+        if (long_name) {
+            path = long_name;
+            long_name = NULL;
+        } else {
+            char name[256 + 1];
+            const char *prefix = (const char *) header + 345;
+            if (memcmp(header + 257, "ustar", 5) == 0 && prefix[0]) {
+                snprintf(name, sizeof(name), "%.155s/%.100s", prefix, (char *) header);
+            } else {
+                snprintf(name, sizeof(name), "%.100s", (char *) header);
+            }
+            path = strdup(name);
+        }
+        char *link = long_link ? long_link : strndup((char *) header + 157, 100);
+        long_link = NULL;
+        if (pax_size >= 0) {
+            size = pax_size;
+            offset = data_offset + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+            pax_size = -1;
+        }
+
+        mode_t mode = tar_number((char *) header + 100, 8) & 07777;
+        if (type == '5') {
+            mode |= S_IFDIR;
+        } else if (type == '2') {
+            mode |= S_IFLNK;
+        } else if (type == '3') {
+            mode |= S_IFCHR;
+        } else if (type == '4') {
+            mode |= S_IFBLK;
+        } else if (type == '6') {
+            mode |= S_IFIFO;
+        } else {
+            mode |= S_IFREG;
+        }
+
+        int index = tar_add_path(tar, path, mode);
+        free(path);
+        if (index > 0) {
+            struct tar_member *m = &tar->members[index];
+            m->data_offset = data_offset;
+            m->size = S_ISREG(mode) ? size : 0;
+            m->mtime = tar_number((char *) header + 136, 12) * 1000000000LL;
+            // a hard link carries no data, it shares that of an earlier member
+            if (type == '1') {
+                int target = tar_find_path(tar, link);
+                if (target > 0 && target != index && S_ISREG(tar->members[target].mode)) {
+                    m->data_offset = tar->members[target].data_offset;
+                    m->size = tar->members[target].size;
+                } else {
+                    m->mode = S_IFLNK | (mode & 07777);
+                }
+            }
+        }
+        free(link);
+    }
+
+    free(long_name);
+    free(long_link);
+    close(fd);
+    return tar;
+}
+
+bool is_tar_archive(const char *path) {
+    const char *dot = strrchr(path, '.');
+    struct stat st;
+    return dot && equal_strings(dot, ".tar") && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// returns the cached index for archive, building it if it changed
+struct tar_index *get_tar_index(const char *archive) {
+    struct stat st;
+    if (stat(archive, &st) != 0) {
+        return NULL;
+    }
+
+    for (struct tar_index **link = &tar_cache; *link; link = &(*link)->next) {
+        struct tar_index *tar = *link;
+        if (tar->dev != st.st_dev || tar->ino != st.st_ino) {
+            continue;
+        }
+        if (tar->mtime == get_mtime_ns(&st)) {
+            return tar;
+        }
+        // stale, blocks already showing it keep the old copy
+        *link = tar->next;
+        release_tar_index(tar);
+        break;
+    }
+
+    struct tar_index *tar = build_tar_index(archive, &st);
+    if (tar) {
+        tar->refs = 1;
+        tar->next = tar_cache;
+        tar_cache = tar;
+    }
+    return tar;
+}
+
+struct dirblock get_archive_dirblock(struct tar_index *tar, int dir, char *path, int column) {
+    int n = 0;
+    for (int i = tar->members[dir].first_child; i >= 0; i = tar->members[i].next_sibling) {
+        n++;
+    }
+
+    struct entry *files = malloc(sizeof(struct entry) * (n > 0 ? n : 1));
+    n = 0;
+    for (int i = tar->members[dir].first_child; i >= 0; i = tar->members[i].next_sibling) {
+        files[n++] = make_entry(strdup(tar->members[i].name));
+    }
+    sort_files(files, n);
+
+    struct dirblock block = {path, n > 0 ? files[0].name : NULL, files, column, n, 0,
+                             get_column_size(files, n), 0, tar->mtime};
+    block.archive = tar;
+    block.archive_dir = dir;
+    tar->refs++;
+    return block;
+}
 
-    return (struct dirblock){path, selected, files, column, fileslen, selected_index, column_size};
+// blocks whose entries are not a plain listing of their path
+bool is_virtual_block(struct dirblock *block) {
+    return block->archive != NULL || block->duplicates || block->comparison;
+}
+
+// member selected in block, -1 outside archives
+int get_selected_member(struct dirblock *block) {
+    if (block->archive == NULL) {
+        return -1;
+    }
+    return tar_lookup(block->archive, block->archive_dir, block->selected);
+}
+
+// copies a member out of the archive, reading it by offset
+bool extract_tar_member(struct tar_index *tar, int member, const char *dest) {
+    struct tar_member *m = &tar->members[member];
+    char buffer[65536];
+
+    int in = open(tar->archive, O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, m->mode & 0777);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    off_t done = 0;
+    bool ok = true;
+    while (done < m->size) {
+        size_t want = m->size - done < (off_t) sizeof(buffer) ? m->size - done : sizeof(buffer);
+        ssize_t got = pread(in, buffer, want, m->data_offset + done);
+        if (got <= 0 || write(out, buffer, got) != got) {
+            ok = false;
+            break;
+        }
+        done += got;
+    }
+
+    close(in);
+    close(out);
+    return ok;
 }
 
 int get_term_height() {
@@ -282,103 +949,248 @@ char *get_new_path(char *path, char *filename) {
     return newpath;
 }
 
-void print_normal_bottom_bar(char *selected_file, char *selected_dir) {
-    char permissions[11];
-    char opt_message[] = "Press o for options";
-    int mes_col = wd.term_width - strlen(opt_message);
-    char *path = get_new_path(wd.current_block->path, wd.current_block->selected);
+// Parallel directory walk. Threads share a stack of pending directories
+// and each one appends what it found under the lock once per directory.
 
-    if (path != NULL) {
-        get_type_and_permissions(permissions, path);
-        free(path);
-        attron(COLOR_PAIR(3));
-        mvprintw(wd.bottom_bar_row, 0, "%s", permissions);
-        mvprintw(wd.bottom_bar_row, mes_col, opt_message);
-        attroff(COLOR_PAIR(3));
-    } else {
-        mvprintw(wd.bottom_bar_row, 0, "Error getting type and permissions"); 
-    }
+struct walk_file
+{
+    char *path;             // relative to the walk root
+    off_t size;
+    int64_t mtime;
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+};
 
-}
+struct walker
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *root;
+    bool include_dirs;
+    char **dirs;
+    int n_dirs;
+    int cap_dirs;
+    int busy;
+    volatile bool cancel;
+    struct walk_file *files;
+    int n_files;
+    int cap_files;
+};
 
-void print_moving_file_bar() {
-    attron(COLOR_PAIR(2));
-    mvprintw(wd.bottom_bar_row, 0, "Directory to move: %s", wd.current_block->path);
-    attroff(COLOR_PAIR(3));
+int get_worker_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 2 ? 2 : (n > 8 ? 8 : n);
 }
 
-void print_bottom_bar(char *selected_file, char *selected_dir)
-{
-    if (wd.moving_file) {
-        print_moving_file_bar();
-    } else {
-        print_normal_bottom_bar(selected_file, selected_dir);
+static void walker_push_dir(struct walker *w, char *dir) {
+    if (w->n_dirs == w->cap_dirs) {
+        w->cap_dirs = w->cap_dirs ? w->cap_dirs * 2 : 64;
+        w->dirs = realloc(w->dirs, sizeof(char *) * w->cap_dirs);
     }
+    w->dirs[w->n_dirs++] = dir;
 }
 
-void filename_formatted(char *src, char *dst, int column_size) {
-    memset(dst, ' ', column_size);
-    if (column_size < strlen(src)) {
-        for (int i = 0; i < column_size - 2; i++) {
-            dst[i + SPACES_AFTER_LEFT_BORDER] = src[i];
-        }
-        dst[column_size - 2] = '~';
-    } else {
-        for (int i = 0; i < strlen(src); i++) {
-            dst[i + SPACES_AFTER_LEFT_BORDER] = src[i];
-        }
+static void walker_add_file(struct walker *w, struct walk_file *file) {
+    if (w->n_files == w->cap_files) {
+        w->cap_files = w->cap_files ? w->cap_files * 2 : 1024;
+        w->files = realloc(w->files, sizeof(struct walk_file) * w->cap_files);
     }
-    dst[column_size] = '\0';
+    w->files[w->n_files++] = *file;
 }
 
-void print_block(struct dirblock block, int index)
-{
-
-    if (index != 1 && index != 0) {
+static void walk_directory(struct walker *w, char *rel) {
+    char *full = rel[0] ? get_new_path((char *) w->root, rel) : strdup(w->root);
+    DIR *dir = opendir(full);
+    free(full);
+    if (!dir) {
         return;
     }
 
-    int column_size;
-    int column;
+    struct walk_file *found = NULL;
+    char **subdirs = NULL;
+    int n_found = 0, n_subdirs = 0, cap = 0, cap_subdirs = 0;
+    struct dirent *entry;
+    struct stat st;
 
-    if (index == 0) {
-        column_size = (get_column_by_index(0) - 2) - 1;
-        column = 1;
-    } else if (index == 1) {
-        column_size = ((get_column_by_index(1) - 2) - 1) - ((get_column_by_index(0) - 2) - 1);
-        column = get_column_by_index(0) - 1;
+    while ((entry = readdir(dir)) != NULL) {
+        if (equal_strings(entry->d_name, ".") || equal_strings(entry->d_name, "..")) {
+            continue;
+        }
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        char *path = rel[0] ? get_new_path(rel, entry->d_name) : strdup(entry->d_name);
+        if (S_ISDIR(st.st_mode)) {
+            if (n_subdirs == cap_subdirs) {
+                cap_subdirs = cap_subdirs ? cap_subdirs * 2 : 16;
+                subdirs = realloc(subdirs, sizeof(char *) * cap_subdirs);
+            }
+            subdirs[n_subdirs++] = path;
+            if (!w->include_dirs) {
+                continue;
+            }
+            path = strdup(path);
+        } else if (!S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (n_found == cap) {
+            cap = cap ? cap * 2 : 64;
+            found = realloc(found, sizeof(struct walk_file) * cap);
+        }
+        found[n_found++] = (struct walk_file){path, st.st_size, get_mtime_ns(&st), st.st_dev, st.st_ino, st.st_mode};
     }
+    closedir(dir);
 
-    int starting_row = wd.box_row + 1;
-    int box_height = (wd.bottom_bar_row - 1) - starting_row;
-    int loop_limit = block.n_files < box_height ? block.n_files : box_height;
-    int offset = 0;
-    if (block.selected_index > box_height - 1) {
-        offset = block.selected_index - (box_height - 1);
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < n_found; i++) {
+        walker_add_file(w, &found[i]);
     }
+    for (int i = 0; i < n_subdirs; i++) {
+        walker_push_dir(w, subdirs[i]);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(found);
+    free(subdirs);
+}
 
-    char fted_string[column_size];
-    for (int i = 0; i < loop_limit; i++) {
-        filename_formatted(block.files[i + offset], fted_string, column_size);
-        if (equal_strings(block.selected, block.files[i + offset])) {
-            attron(COLOR_PAIR(1));
-            mvprintw(starting_row, column, "%s", fted_string);
-            attroff(COLOR_PAIR(1));
+static void *walk_worker(void *arg) {
+    struct walker *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->n_dirs == 0 && w->busy > 0 && !w->cancel) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->n_dirs == 0 || w->cancel) {
+            break;
+        }
+        char *dir = w->dirs[--w->n_dirs];
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        walk_directory(w, dir);
+        free(dir);
+
+        pthread_mutex_lock(&w->lock);
+        w->busy--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Walks root with a pool of threads. Regular files (and directories when
+// include_dirs is set) end up in w->files with paths relative to root.
+void parallel_walk(struct walker *w, const char *root, bool include_dirs) {
+    int n_threads = get_worker_count();
+    pthread_t threads[n_threads];
+
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->root = root;
+    w->include_dirs = include_dirs;
+    walker_push_dir(w, strdup(""));
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, walk_worker, w);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < w->n_dirs; i++) {
+        free(w->dirs[i]);
+    }
+    free(w->dirs);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+void free_walk_files(struct walk_file *files, int n_files) {
+    for (int i = 0; i < n_files; i++) {
+        free(files[i].path);
+    }
+    free(files);
+}
+
+void print_normal_bottom_bar(char *selected_file, char *selected_dir) {
+    char permissions[11];
+    char opt_message[] = "Press o for options";
+    int mes_col = wd.term_width - strlen(opt_message);
+    char *path = get_new_path(wd.current_block->path, wd.current_block->selected);
+    int member = get_selected_member(wd.current_block);
+
+    if (path != NULL) {
+        if (member >= 0) {
+            format_type_and_permissions(permissions, wd.current_block->archive->members[member].mode);
         } else {
-            mvprintw(starting_row, column, "%s", fted_string);
+            get_type_and_permissions(permissions, path);
         }
-        starting_row++;
+        free(path);
+        attron(COLOR_PAIR(3));
+        mvprintw(wd.bottom_bar_row, 0, "%s", permissions);
+        mvprintw(wd.bottom_bar_row, mes_col, opt_message);
+        attroff(COLOR_PAIR(3));
+    } else {
+        mvprintw(wd.bottom_bar_row, 0, "Error getting type and permissions"); 
     }
+
 }
 
-void print_blocks(struct dirblock *blocks, int block_q)
+void print_moving_file_bar() {
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Directory to move: %s", wd.current_block->path);
+    attroff(COLOR_PAIR(3));
+}
+
+void print_compare_bar() {
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Compare %s with: (c, or C to hash ties)", wd.compare_source);
+    attroff(COLOR_PAIR(2));
+}
+
+void print_bottom_bar(char *selected_file, char *selected_dir)
 {
-    if (block_q >= 2) {
-        print_block(blocks[block_q - 1], 1);
-        print_block(blocks[block_q - 2], 0);
-    } else if (block_q == 1) {
-        print_block(blocks[0], 0);
+    if (wd.moving_file) {
+        print_moving_file_bar();
+    } else if (wd.compare_source) {
+        print_compare_bar();
+    } else {
+        print_normal_bottom_bar(selected_file, selected_dir);
+    }
+}
+
+// prints the entry padded to column_size, ending in '~' when it does not fit
+void print_entry(int row, int column, const struct entry *e, int column_size) {
+    int room = column_size - SPACES_AFTER_LEFT_BORDER - 1;
+    int chars, width;
+
+    if (room < 1) {
+        return;
+    }
+    if (e->width <= room) {
+        chars = get_entry_cut(e, room);
+        width = e->width;
+    } else {
+        chars = get_entry_cut(e, room - 1);
+        width = get_entry_cut_width(e, room - 1);
     }
+
+    mvprintw(row, column, "%*s", SPACES_AFTER_LEFT_BORDER, "");
+    if (e->wname) {
+        addnwstr(e->wname, chars);
+    } else {
+        addnstr(e->name, chars);
+    }
+    if (e->width > room) {
+        addch('~');
+        width++;
+    }
+    printw("%*s", column_size - SPACES_AFTER_LEFT_BORDER - width, "");
 }
 
 char *get_next_file(struct dirblock *block, int blocklen)
@@ -386,15 +1198,15 @@ char *get_next_file(struct dirblock *block, int blocklen)
     char *next_file;
     for (int i = 0; i < blocklen; i++)
     {
-        if (equal_strings(block->files[i], block->selected))
+        if (equal_strings(block->files[i].name, block->selected))
         {
             if (i == blocklen - 1)
             {
-                next_file = strdup(block->files[0]);
+                next_file = strdup(block->files[0].name);
             }
             else
             {
-                next_file = strdup(block->files[i + 1]);
+                next_file = strdup(block->files[i + 1].name);
             }
         }
     }
@@ -407,15 +1219,15 @@ char *get_previous_file(struct dirblock *block, int blocklen)
     char *prev_file;
     for (int i = 0; i < blocklen; i++)
     {
-        if (equal_strings(block->files[i], block->selected))
+        if (equal_strings(block->files[i].name, block->selected))
         {
             if (i == 0)
             {
-                prev_file = strdup(block->files[blocklen - 1]);
+                prev_file = strdup(block->files[blocklen - 1].name);
             }
             else
             {
-                prev_file = strdup(block->files[i - 1]);
+                prev_file = strdup(block->files[i - 1].name);
             }
         }
     }
@@ -439,10 +1251,10 @@ int get_next_column(struct dirblock *blocks, int block_q)
     return nc;
 }
 
-bool can_draw_next_block(char *path, struct dirblock *blocks, int block_q)
+bool can_draw_next_block(struct dirblock *next, struct dirblock *blocks, int block_q)
 {
     int nc = get_next_column(blocks, block_q);
-    int longest_name = get_size_longest_name(path);
+    int longest_name = get_size_longest_name(next->files, next->n_files);
     int right_limit = nc + longest_name;
 
     if (right_limit < wd.term_width)
@@ -502,19 +1314,438 @@ void print_borders(struct dirblock *blocks, int block_q, int starting_row)
     }
 }
 
+// Benchmark: --record FILE writes every key read, with the milliseconds
+// since the loop started, and --replay FILE feeds those keys back to a synthetic
+// tree drawn on a pseudo-terminal. Each replayed key is timed until the
+// frame it causes has been written out.
+
+#define BENCH_ROWS  40
+#define BENCH_COLS  120
+
+struct bench
+{
+    FILE *record;
+    bool replaying;
+    int *keys;
+    int n_keys;
+    int next_key;
+    int unread;             // keys pushed back with ungetch, recorded already
+    int64_t start;
+    int64_t key_time;       // when the key being handled was read, 0 once drawn
+    int64_t *latencies;
+    int n_latencies;
+    SCREEN *screen;
+    FILE *terminal;
+    int master_fd;
+    pthread_t drain_thread;
+    int64_t bytes;          // written to the terminal
+};
+
+struct bench bn;
+
+int64_t get_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Every key goes through here so it can be recorded or replayed. A replay
+// that has run out answers q until the program exits.
+int read_key(void) {
+    if (bn.replaying) {
+        return bn.next_key < bn.n_keys ? bn.keys[bn.next_key++] : 'q';
+    }
+    int ch = getch();
+    if (ch != ERR && bn.unread > 0) {
+        bn.unread--;
+        return ch;
+    }
+    if (bn.record != NULL && ch != ERR) {
+        fprintf(bn.record, "%lld %d\n", (long long) ((get_monotonic_ns() - bn.start) / 1000000), ch);
+    }
+    return ch;
+}
+
+// called once a frame is on the terminal
+void bench_frame_done(void) {
+    if (bn.key_time == 0) {
+        return;
+    }
+    bn.latencies = realloc(bn.latencies, sizeof(int64_t) * (bn.n_latencies + 1));
+    bn.latencies[bn.n_latencies++] = get_monotonic_ns() - bn.key_time;
+    bn.key_time = 0;
+}
+
 void start_ncurses(void)
 {
-    initscr();     // Inicia ncurses
+    if (bn.screen == NULL) {
+        initscr(); // Inicia ncurses
+    }
     noecho();      // No mostrar teclas pulsadas
     start_color(); // Habilitar colores
     init_pair(1, COLOR_BLACK, COLOR_CYAN);
     init_pair(2, COLOR_GREEN, COLOR_BLACK);
     init_pair(3, COLOR_RED, COLOR_BLACK);
+    init_pair(4, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(5, COLOR_BLUE, COLOR_BLACK);
+    init_pair(6, COLOR_MAGENTA, COLOR_BLACK);
+    init_pair(7, COLOR_CYAN, COLOR_BLACK);
     cbreak();             // Leer input sin esperar Enter
     keypad(stdscr, TRUE); // Habilitar teclas especiales
     curs_set(0);          // Oculta el cursor
 }
 
+// Event loop. The main loop sleeps in poll() on the terminal, a signal
+// descriptor, a wakeup descriptor background threads write to when they
+// have something to show, and the watches on the listed directories.
+// Linux gets signalfd, eventfd and inotify; elsewhere the signals and
+// wakeups go through pipes and the watches through kqueue.
+
+#define EVENT_INPUT  1
+#define EVENT_WAKE   2
+#define EVENT_RESIZE 4
+#define EVENT_QUIT   8
+#define EVENT_WATCH  16
+
+// what has to be drawn again
+#define DIRTY_PREVIEW 1
+#define DIRTY_ALL     3
+
+#define MAX_DIR_WATCHES 16
+
+struct dir_watch
+{
+    char *path;
+    int id;                     // inotify watch, or the descriptor kqueue watches
+};
+
+struct events
+{
+    int signal_fd;              // signalfd, or the read end of the signal pipe
+    int signal_write_fd;
+    int wake_fd;                // eventfd, or the read end of the wake pipe
+    int wake_write_fd;
+    int watch_fd;               // inotify or kqueue, -1 when unavailable
+    struct dir_watch watches[MAX_DIR_WATCHES];
+    int n_watches;
+};
+
+struct events ev;
+
+// Follow mode: the tail of the selected file, kept up to date from the
+// file watch. Only the bytes appended since the last read are read.
+
+#define FOLLOW_LINES      256
+#define FOLLOW_TAIL_BYTES (256 * 1024)
+#define FOLLOW_READ_CHUNK (64 * 1024)
+
+struct follow
+{
+    char *path;                 // NULL when not following
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;               // bytes read so far
+    int watch_id;               // inotify watch, or the descriptor kqueue watches
+    bool pending;               // the watch fired since the last read
+    char *lines[FOLLOW_LINES];  // ring of the last complete lines
+    int n_lines;
+    int head;                   // oldest line
+    char *partial;              // line still being written
+    size_t partial_len;
+    char *pattern;              // highlighted substring, NULL for none
+    int language;
+};
+
+struct follow fl;
+
+#if !defined(__linux__)
+static void forward_signal(int signo) {
+    int saved = errno;
+    unsigned char byte = signo;
+    if (write(ev.signal_write_fd, &byte, 1) < 0) {
+        // the pipe is full, a wakeup is already pending
+    }
+    errno = saved;
+}
+
+static void make_pipe(int *read_fd, int *write_fd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        *read_fd = *write_fd = -1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *read_fd = fds[0];
+    *write_fd = fds[1];
+}
+#endif
+
+// Has to run before any thread is created: on Linux the signals are
+// blocked everywhere and only read from the signalfd.
+void start_events(void) {
+    int signals[] = {SIGWINCH, SIGTERM, SIGHUP};
+
+#if defined(__linux__)
+    sigset_t set;
+    sigemptyset(&set);
+    for (int i = 0; i < 3; i++) {
+        sigaddset(&set, signals[i]);
+    }
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    ev.signal_fd = ev.signal_write_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    ev.wake_fd = ev.wake_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    make_pipe(&ev.signal_fd, &ev.signal_write_fd);
+    make_pipe(&ev.wake_fd, &ev.wake_write_fd);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward_signal;
+    sigemptyset(&sa.sa_mask);
+    for (int i = 0; i < 3; i++) {
+        sigaction(signals[i], &sa, NULL);
+    }
+    ev.watch_fd = kqueue();
+#endif
+    ev.n_watches = 0;
+}
+
+// called from any thread once it has results for the screen
+void wake_main_loop(void) {
+#if defined(__linux__)
+    uint64_t one = 1;
+    if (write(ev.wake_write_fd, &one, sizeof(one)) < 0) {
+        // the counter saturated, the loop is awake anyway
+    }
+#else
+    char byte = 0;
+    if (write(ev.wake_write_fd, &byte, 1) < 0) {
+        // the pipe is full, the loop is awake anyway
+    }
+#endif
+}
+
+static int read_signals(void) {
+    int events = 0;
+#if defined(__linux__)
+    struct signalfd_siginfo info;
+    while (read(ev.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        events |= info.ssi_signo == SIGWINCH ? EVENT_RESIZE : EVENT_QUIT;
+    }
+#else
+    unsigned char byte;
+    while (read(ev.signal_fd, &byte, 1) == 1) {
+        events |= byte == SIGWINCH ? EVENT_RESIZE : EVENT_QUIT;
+    }
+#endif
+    return events;
+}
+
+// sleeps until something happens and says what, as EVENT_* bits
+int wait_for_events(void) {
+    struct pollfd fds[4] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {ev.signal_fd, POLLIN, 0},
+        {ev.wake_fd, POLLIN, 0},
+        {ev.watch_fd, POLLIN, 0},
+    };
+    int n_fds = ev.watch_fd >= 0 ? 4 : 3;
+    int events = 0;
+
+    while (poll(fds, n_fds, -1) < 0) {
+        if (errno != EINTR) {
+            return EVENT_QUIT;
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        events |= EVENT_INPUT;
+    } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+        events |= EVENT_QUIT; // the terminal is gone
+    }
+    if (fds[1].revents & POLLIN) {
+        events |= read_signals();
+    }
+    if (fds[2].revents & POLLIN) {
+        char buffer[64];
+        while (read(ev.wake_fd, buffer, sizeof(buffer)) > 0);
+        events |= EVENT_WAKE;
+    }
+    if (n_fds == 4 && (fds[3].revents & POLLIN)) {
+        events |= EVENT_WATCH;
+    }
+    return events;
+}
+
+// next key already typed, ERR when there is none left
+int read_pending_key(void) {
+    timeout(0);
+    int ch = read_key();
+    timeout(-1);
+    if (bn.replaying) {
+        bn.key_time = get_monotonic_ns();
+    }
+    return ch;
+}
+
+// follows the terminal size after a SIGWINCH
+void handle_resize(void) {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 || w.ws_row == 0 || w.ws_col == 0) {
+        return;
+    }
+    resizeterm(w.ws_row, w.ws_col);
+    wd.term_height = w.ws_row;
+    wd.term_width = w.ws_col;
+    wd.bottom_bar_row = wd.term_height - 1;
+}
+
+// Prefetch: once the selection has rested on an entry for PREFETCH_DELAY_MS,
+// a low priority thread lists it if it is a directory, so KEY_RIGHT can
+// adopt the listing instead of scanning. Moving the selection cancels it.
+
+#define PREFETCH_DELAY_MS  150
+#define PREFETCH_MAX_FILES 20000
+#define PREFETCH_MAX_BYTES (4 * 1024 * 1024)
+
+struct prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *path;                 // entry the selection is on
+    unsigned long requested;    // bumped on every selection change
+    unsigned long handled;
+    char *result_path;
+    struct entry *files;
+    int n_files;
+    int column_size;
+    int64_t mtime;
+};
+
+struct prefetch pf;
+
+static void set_low_priority(void) {
+#if defined(__linux__)
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#elif defined(__APPLE__)
+    pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#endif
+}
+
+void *prefetch_worker(void *arg) {
+    set_low_priority();
+
+    pthread_mutex_lock(&pf.lock);
+    while (1) {
+        while (pf.requested == pf.handled) {
+            pthread_cond_wait(&pf.cond, &pf.lock);
+        }
+
+        unsigned long generation = pf.requested;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PREFETCH_DELAY_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (pf.requested == generation && pthread_cond_timedwait(&pf.cond, &pf.lock, &deadline) != ETIMEDOUT);
+        if (pf.requested != generation || pf.path == NULL ||
+            (pf.result_path && equal_strings(pf.result_path, pf.path) && get_dir_mtime(pf.path) == pf.mtime)) {
+            pf.handled = generation;
+            continue;
+        }
+
+        char *path = strdup(pf.path);
+        pthread_mutex_unlock(&pf.lock);
+
+        struct scan_limits limits = {PREFETCH_MAX_FILES, PREFETCH_MAX_BYTES, &pf.requested, generation};
+        struct entry *files = NULL;
+        int n_files = 0;
+        int64_t mtime = get_dir_mtime(path);
+        if (is_directory(path)) {
+            files = get_files_limited(path, &n_files, &limits);
+        }
+        if (files) {
+            sort_files(files, n_files);
+        }
+
+        pthread_mutex_lock(&pf.lock);
+        if (files && pf.requested == generation) {
+            free(pf.result_path);
+            free_files(pf.files, pf.n_files);
+            pf.result_path = path;
+            pf.files = files;
+            pf.n_files = n_files;
+            pf.column_size = get_column_size(files, n_files);
+            pf.mtime = mtime;
+            wake_main_loop();
+        } else {
+            free(path);
+            if (files) {
+                free_files(files, n_files);
+            }
+        }
+        pf.handled = generation;
+    }
+    return NULL;
+}
+
+void start_prefetch(void) {
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.cond, NULL);
+    // a replay never prefetches, so no timer runs alongside it
+    if (!bn.replaying && pthread_create(&pf.thread, NULL, prefetch_worker, NULL) == 0) {
+        pthread_detach(pf.thread);
+    }
+}
+
+// points the prefetcher at path, NULL to stop it
+void request_prefetch(const char *path) {
+    pthread_mutex_lock(&pf.lock);
+    if (!equal_strings(pf.path, path) && (pf.path || path)) {
+        free(pf.path);
+        pf.path = path ? strdup(path) : NULL;
+        pf.requested++;
+        pthread_cond_signal(&pf.cond);
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
+
+// hands over the prefetched listing of path if it is still current
+bool take_prefetched(const char *path, struct dirblock *block) {
+    bool taken = false;
+    pthread_mutex_lock(&pf.lock);
+    if (pf.result_path && equal_strings(pf.result_path, path) && get_dir_mtime(path) == pf.mtime) {
+        block->files = pf.files;
+        block->n_files = pf.n_files;
+        block->column_size = pf.column_size;
+        block->mtime = pf.mtime;
+        block->selected = pf.n_files > 0 ? pf.files[0].name : NULL;
+        free(pf.result_path);
+        pf.result_path = NULL;
+        pf.files = NULL;
+        pf.n_files = 0;
+        taken = true;
+    }
+    pthread_mutex_unlock(&pf.lock);
+    return taken;
+}
+
+// child column in the preview pane, drawn from the prefetched listing
+void print_prefetched_listing(const char *path, int row, int column, int rows, int width) {
+    pthread_mutex_lock(&pf.lock);
+    if (pf.result_path && equal_strings(pf.result_path, path)) {
+        for (int i = 0; i < pf.n_files && i < rows; i++) {
+            print_entry(row + i, column - SPACES_AFTER_LEFT_BORDER, &pf.files[i], width);
+        }
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
+
 void add_block()
 {
     if (wd.block_quantity == 0)
@@ -529,185 +1760,698 @@ void add_block()
         int next_column = get_next_column(wd.blocks, wd.block_quantity);
         char *newpath = get_new_path(wd.current_block->path, wd.current_block->selected);
         if (newpath != NULL) {
+            struct dirblock block = {newpath, NULL, NULL, next_column};
+            if (!take_prefetched(newpath, &block)) {
+                block = get_dirblock(newpath, next_column);
+            }
             wd.blocks = realloc(wd.blocks, sizeof(struct dirblock) * (wd.block_quantity + 1));
-            wd.blocks[wd.block_quantity] = get_dirblock(newpath, next_column);
+            wd.blocks[wd.block_quantity] = block;
             wd.current_block = &wd.blocks[wd.block_quantity];
             wd.block_quantity++;
         }
     }
 }
 
+void add_archive_block(struct tar_index *tar, int dir)
+{
+    int next_column = get_next_column(wd.blocks, wd.block_quantity);
+    char *newpath = get_new_path(wd.current_block->path, wd.current_block->selected);
+    if (newpath != NULL) {
+        wd.blocks = realloc(wd.blocks, sizeof(struct dirblock) * (wd.block_quantity + 1));
+        wd.blocks[wd.block_quantity] = get_archive_dirblock(tar, dir, newpath, next_column);
+        wd.current_block = &wd.blocks[wd.block_quantity];
+        wd.block_quantity++;
+    }
+}
+
+// frees what blocks[index] owns; the path of the first one is wd.path
+void free_block(int index) {
+    free_files(wd.blocks[index].files, wd.blocks[index].n_files);
+    if (wd.blocks[index].archive != NULL) {
+        release_tar_index(wd.blocks[index].archive);
+    }
+    if (index > 0) {
+        free(wd.blocks[index].path);
+    }
+}
+
 void delete_block() {
     if (wd.block_quantity > 1) {
+        free_block(wd.block_quantity - 1);
         wd.blocks = realloc(wd.blocks, sizeof(struct dirblock) * (wd.block_quantity - 1));
         wd.current_block = &wd.blocks[wd.block_quantity - 2];
         wd.block_quantity--;
     }
 }
 
-void start_window(char *path)
+// Session snapshot: the block stack and its listings are written on exit
+// and painted straight from disk on the next launch, before any scan.
+
+struct revalidation
 {
-    wd.moving_file = false;
-    wd.term_height = get_term_height();
-    wd.term_width = get_term_width();
-    wd.top_bar_row = 0;
-    wd.box_row = 1;
-    wd.bottom_bar_row = wd.term_height - 1;
-    wd.block_quantity = 0;
-    wd.path = path;
-    add_block();
-}
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int n_blocks;
+    char **paths;
+    int64_t *mtimes;
+    int *columns;
+    struct dirblock *fresh;
+    bool *ready;
+    bool done;
+};
 
-void show_message_bottom_bar(const char *message) {
-    move(wd.bottom_bar_row, 0);
-    clrtoeol();
+struct revalidation rv;
 
-    attron(COLOR_PAIR(2));
-    mvprintw(wd.bottom_bar_row, 0, "%s, press any key to continue", message);
-    attroff(COLOR_PAIR(2));
-    getch();
+// path of name under mordred's state directory, NULL without a home
+char *get_state_path(const char *name) {
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    char *path = malloc(PATH_MAX);
+
+    if (state && state[0] != '\0') {
+        snprintf(path, PATH_MAX, "%s/mordred/%s", state, name);
+    } else if (home) {
+        snprintf(path, PATH_MAX, "%s/.local/state/mordred/%s", home, name);
+    } else {
+        free(path);
+        return NULL;
+    }
+    return path;
 }
 
-bool delete_file(const char *path) {
-    struct stat st;
-    
-    if (stat(path, &st) != 0) {
-        if (errno == ENOENT) {
-            show_message_bottom_bar("Could not delete: file does not exist!");
-        } else {
-            show_message_bottom_bar("Could not delete: error verifying file");
+// creates every missing directory leading to the file in path
+void make_parent_dirs(const char *path, mode_t mode) {
+    char *tmp = strdup(path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, mode);
+            *p = '/';
         }
-        return false;
-    }
-    
-    if (!S_ISREG(st.st_mode)) {
-        show_message_bottom_bar("Could not delete: file is not a regular file");
-        return false;
-    }
-    
-    if (remove(path) == 0) {
-        return true;
-    } else {
-        show_message_bottom_bar("Could not delete: error deleting file");
-        return false;
     }
+    free(tmp);
 }
 
-bool create_file(char *filename) {
-    FILE *file;
-    char *path = get_new_path(wd.current_block->path, filename);
+void write_u32(FILE *fp, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
 
-    if (path == NULL) {
-        show_message_bottom_bar("Error, could not create new file");
-        return false;
+void write_i64(FILE *fp, int64_t value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+void write_string(FILE *fp, const char *str) {
+    uint32_t len = str ? strlen(str) : 0;
+    write_u32(fp, len);
+    if (len > 0) {
+        fwrite(str, 1, len, fp);
     }
+}
 
-    file = fopen(path, "w");
-    if (file == NULL) {
-        show_message_bottom_bar("Error, could not create new file");
+bool read_u32(FILE *fp, uint32_t *value) {
+    return fread(value, sizeof(*value), 1, fp) == 1;
+}
+
+bool read_i64(FILE *fp, int64_t *value) {
+    return fread(value, sizeof(*value), 1, fp) == 1;
+}
+
+char *read_string(FILE *fp) {
+    uint32_t len;
+    if (!read_u32(fp, &len) || len > PATH_MAX) {
+        return NULL;
+    }
+    char *str = malloc(len + 1);
+    if (fread(str, 1, len, fp) != len) {
+        free(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+void save_session(void) {
+    char root[PATH_MAX];
+    char *session = get_state_path("session");
+    if (session == NULL || realpath(wd.path, root) == NULL) {
+        free(session);
+        return;
+    }
+
+    make_parent_dirs(session, 0700);
+    size_t tmp_size = strlen(session) + strlen(".tmp") + 1;
+    char tmp[tmp_size];
+    snprintf(tmp, tmp_size, "%s.tmp", session);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(session);
+        return;
+    }
+
+    fwrite(SESSION_MAGIC, 1, 4, fp);
+    write_u32(fp, SESSION_VERSION);
+    // virtual blocks are not saved, the stack stops at the first one
+    int block_q = 0;
+    while (block_q < wd.block_quantity && !is_virtual_block(&wd.blocks[block_q])) {
+        block_q++;
+    }
+
+    write_string(fp, root);
+    write_u32(fp, block_q);
+    for (int i = 0; i < block_q; i++) {
+        struct dirblock *block = &wd.blocks[i];
+        write_string(fp, block->selected);
+        write_u32(fp, block->selected_index);
+        write_u32(fp, block->offset);
+        write_i64(fp, block->mtime);
+        write_u32(fp, block->n_files);
+        for (int j = 0; j < block->n_files; j++) {
+            write_string(fp, block->files[j].name);
+        }
+    }
+
+    // rename over the old snapshot so a crash never leaves a torn file
+    if (fclose(fp) == 0) {
+        rename(tmp, session);
+    } else {
+        remove(tmp);
+    }
+    free(session);
+}
+
+bool read_session_block(FILE *fp, struct dirblock *block) {
+    uint32_t selected_index, offset, n_files;
+    char *selected = read_string(fp);
+
+    // fields the snapshot does not carry start out zeroed
+    *block = (struct dirblock){0};
+    if (!selected || !read_u32(fp, &selected_index) || !read_u32(fp, &offset) ||
+        !read_i64(fp, &block->mtime) || !read_u32(fp, &n_files)) {
+        free(selected);
         return false;
     }
 
-    fclose(file);
+    block->files = malloc(sizeof(struct entry) * (n_files > 0 ? n_files : 1));
+    block->n_files = 0;
+    for (uint32_t i = 0; i < n_files; i++) {
+        char *file = read_string(fp);
+        if (!file) {
+            free(selected);
+            free_files(block->files, block->n_files);
+            return false;
+        }
+        block->files[block->n_files++] = make_entry(file);
+    }
+
+    block->selected_index = selected_index < n_files ? selected_index : 0;
+    block->selected = n_files > 0 ? block->files[block->selected_index].name : NULL;
+    // an empty directory saved its NULL selection as ""
+    if (n_files > 0 ? !equal_strings(block->selected, selected) : selected[0] != '\0') {
+        free(selected);
+        free_files(block->files, block->n_files);
+        return false;
+    }
+    free(selected);
+    block->offset = offset;
+    block->column_size = get_column_size(block->files, block->n_files);
     return true;
 }
 
-void new_file_bar() {
-    int ch;
-    char *new_name = malloc(wd.term_width * sizeof(char));
-    char message[] = "New file name: ";
-    int message_len = strlen(message);
-    int column = message_len;
-    int i = 0;
+// restores the block stack saved for the same starting directory
+bool load_session(char *path) {
+    char root[PATH_MAX];
+    char magic[4];
+    uint32_t version, block_q;
+    char *session = get_state_path("session");
+    if (session == NULL || realpath(path, root) == NULL) {
+        free(session);
+        return false;
+    }
 
-    while (1) {   
-        move(wd.bottom_bar_row, 0);
-        clrtoeol();
-        attron(COLOR_PAIR(2));
-        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, new_name);
-        attroff(COLOR_PAIR(2));
+    FILE *fp = fopen(session, "rb");
+    free(session);
+    if (!fp) {
+        return false;
+    }
+
+    char *saved_root = NULL;
+    bool ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, SESSION_MAGIC, 4) == 0 &&
+              read_u32(fp, &version) && version == SESSION_VERSION &&
+              (saved_root = read_string(fp)) != NULL && equal_strings(saved_root, root) &&
+              read_u32(fp, &block_q) && block_q > 0;
+    free(saved_root);
+    if (!ok) {
+        fclose(fp);
+        return false;
+    }
 
-        ch = getch();
+    wd.blocks = malloc(sizeof(struct dirblock) * block_q);
+    wd.block_quantity = 0;
+    for (uint32_t i = 0; i < block_q; i++) {
+        struct dirblock *block = &wd.blocks[i];
+        if (!read_session_block(fp, block)) {
+            break;
+        }
+        if (i == 0) {
+            block->path = path;
+        } else {
+            block->path = get_new_path(wd.blocks[i - 1].path, wd.blocks[i - 1].selected);
+        }
+        block->column = get_next_column(wd.blocks, i);
+        wd.block_quantity++;
+    }
+    fclose(fp);
 
-        if (ch == KEY_BACKSPACE || ch == 127) {
-            if (column > message_len) {
-                i--;
-                new_name[i] = '\0';
-                column--;
-                mvaddch(wd.bottom_bar_row, column, ' ');
-                move(wd.bottom_bar_row, column);
-            } 
+    if (wd.block_quantity == 0) {
+        free(wd.blocks);
+        return false;
+    }
+    wd.current_block = &wd.blocks[wd.block_quantity - 1];
+    return true;
+}
+
+void *revalidate_blocks(void *arg) {
+    for (int i = 0; i < rv.n_blocks; i++) {
+        if (get_dir_mtime(rv.paths[i]) == rv.mtimes[i]) {
             continue;
-        } else if (ch == KEY_ENTER || ch == K_ENTER) {
-            if (column > message_len) {
-                break;
-            } else {
-                show_message_bottom_bar("Filename cannot be empty");
-                continue;
-            }
         }
+        struct dirblock fresh = get_dirblock(rv.paths[i], rv.columns[i]);
+        pthread_mutex_lock(&rv.lock);
+        rv.fresh[i] = fresh;
+        rv.ready[i] = true;
+        pthread_mutex_unlock(&rv.lock);
+        wake_main_loop();
+    }
 
-        attron(COLOR_PAIR(2));
-        mvaddch(wd.bottom_bar_row, column++, ch);
-        attroff(COLOR_PAIR(2));
-        new_name[i++] = ch;  
-        if (column >= wd.term_width - 1) {
+    pthread_mutex_lock(&rv.lock);
+    rv.done = true;
+    pthread_mutex_unlock(&rv.lock);
+    wake_main_loop();
+    return NULL;
+}
+
+void adopt_block_listing(int index, struct dirblock *fresh) {
+    struct dirblock *block = &wd.blocks[index];
+    int selected_index = -1;
+
+    for (int i = 0; i < fresh->n_files; i++) {
+        if (equal_strings(fresh->files[i].name, block->selected)) {
+            selected_index = i;
             break;
         }
     }
 
-    new_name[i] = '\0';
+    // the directory we were inside is gone, so is everything right of it
+    if (selected_index < 0 && index < wd.block_quantity - 1) {
+        for (int i = index + 1; i < wd.block_quantity; i++) {
+            free_block(i);
+        }
+        wd.block_quantity = index + 1;
+        wd.current_block = &wd.blocks[index];
+    }
+    if (selected_index < 0) {
+        selected_index = block->selected_index < fresh->n_files ? block->selected_index : 0;
+    }
 
-    attron(COLOR_PAIR(2));
-    mvprintw(wd.bottom_bar_row, 0, "Create file %s? [y/n]", new_name);
-    attroff(COLOR_PAIR(2));
-    ch = getch();
-    if (ch == 'y' || ch == 'Y') {
-        if (create_file(new_name)) {
-            *wd.current_block = get_dirblock(wd.current_block->path, wd.current_block->column);
-            show_message_bottom_bar("File created successfully");
+    free_files(block->files, block->n_files);
+    block->files = fresh->files;
+    block->n_files = fresh->n_files;
+    block->column_size = fresh->column_size;
+    block->mtime = fresh->mtime;
+    block->selected_index = selected_index;
+    block->selected = block->n_files > 0 ? block->files[selected_index].name : NULL;
+}
+
+// takes what the revalidation found so far, true when a block changed
+bool adopt_revalidated_blocks(void) {
+    bool adopted = false;
+
+    if (!wd.revalidating) {
+        return false;
+    }
+
+    pthread_mutex_lock(&rv.lock);
+    for (int i = 0; i < rv.n_blocks; i++) {
+        if (!rv.ready[i]) {
+            continue;
+        }
+        rv.ready[i] = false;
+        if (i < wd.block_quantity && !is_virtual_block(&wd.blocks[i]) && equal_strings(wd.blocks[i].path, rv.paths[i])) {
+            adopt_block_listing(i, &rv.fresh[i]);
+            adopted = true;
         } else {
-            show_message_bottom_bar("There was an error creating the file");
+            free_files(rv.fresh[i].files, rv.fresh[i].n_files);
         }
-        free(new_name);
-    } else {
-        show_message_bottom_bar("File will not be created");
     }
+    bool done = rv.done;
+    pthread_mutex_unlock(&rv.lock);
+
+    if (!done) {
+        return adopted;
+    }
+
+    if (!bn.replaying) {
+        pthread_join(rv.thread, NULL);
+    }
+    pthread_mutex_destroy(&rv.lock);
+    for (int i = 0; i < rv.n_blocks; i++) {
+        free(rv.paths[i]);
+    }
+    free(rv.paths);
+    free(rv.mtimes);
+    free(rv.columns);
+    free(rv.fresh);
+    free(rv.ready);
+    wd.revalidating = false;
+    return adopted;
 }
 
-void delete_bar() {
-    int ch;
-    bool deleted = false;
-    attron(COLOR_PAIR(2));
-    mvprintw(wd.bottom_bar_row, 0, "Are you sure you want to delete the file %s? [y/n]", wd.current_block->selected);
-    attroff(COLOR_PAIR(2));
+// checks every restored block against the disk without blocking the first paint
+void start_revalidation(void) {
+    rv.n_blocks = wd.block_quantity;
+    rv.paths = malloc(sizeof(char *) * rv.n_blocks);
+    rv.mtimes = malloc(sizeof(int64_t) * rv.n_blocks);
+    rv.columns = malloc(sizeof(int) * rv.n_blocks);
+    rv.fresh = malloc(sizeof(struct dirblock) * rv.n_blocks);
+    rv.ready = calloc(rv.n_blocks, sizeof(bool));
+    rv.done = false;
+    for (int i = 0; i < rv.n_blocks; i++) {
+        rv.paths[i] = strdup(wd.blocks[i].path);
+        rv.mtimes[i] = wd.blocks[i].mtime;
+        rv.columns[i] = wd.blocks[i].column;
+    }
 
-    ch = getch();
-    if (ch == 'y' || ch == 'Y') {
-        char *path = get_new_path(wd.current_block->path, wd.current_block->selected);
-        if (path == NULL) {
-            show_message_bottom_bar("Could not delete: error deleting file");
-            return;
+    pthread_mutex_init(&rv.lock, NULL);
+    if (bn.replaying) {
+        // a replay checks them before its first frame so no thread races it
+        revalidate_blocks(NULL);
+        wd.revalidating = true;
+        adopt_revalidated_blocks();
+        return;
+    }
+    if (pthread_create(&rv.thread, NULL, revalidate_blocks, NULL) != 0) {
+        // the listings from the snapshot stay as they are
+        pthread_mutex_destroy(&rv.lock);
+        for (int i = 0; i < rv.n_blocks; i++) {
+            free(rv.paths[i]);
         }
-        deleted = delete_file(path);
-        free(path);
-    } else if (ch == 'n' || ch == 'N') {
+        free(rv.paths);
+        free(rv.mtimes);
+        free(rv.columns);
+        free(rv.fresh);
+        free(rv.ready);
         return;
-    } else {
-        show_message_bottom_bar("Wrong option selected: file will not be deleted");
+    }
+    wd.revalidating = true;
+}
+
+static void remove_dir_watch(int index) {
+#if defined(__linux__)
+    inotify_rm_watch(ev.watch_fd, ev.watches[index].id);
+#else
+    close(ev.watches[index].id); // closing drops it from the kqueue
+#endif
+    free(ev.watches[index].path);
+    ev.watches[index] = ev.watches[--ev.n_watches];
+}
+
+static void add_dir_watch(const char *path) {
+    int id;
+#if defined(__linux__)
+    // IN_ATTRIB and IN_CLOSE_WRITE catch entries whose size or mtime changed
+    id = inotify_add_watch(ev.watch_fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                              IN_ATTRIB | IN_CLOSE_WRITE |
+                                              IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#else
+    struct kevent change;
+    id = open(path, O_EVTONLY | O_DIRECTORY | O_CLOEXEC);
+    if (id >= 0) {
+        // a directory vnode only reports its own changes, not those of its entries
+        EV_SET(&change, id, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME,
+               0, NULL);
+        if (kevent(ev.watch_fd, &change, 1, NULL, 0, NULL) != 0) {
+            close(id);
+            id = -1;
+        }
+    }
+#endif
+    if (id >= 0) {
+        ev.watches[ev.n_watches++] = (struct dir_watch){strdup(path), id};
+    }
+}
+
+static bool is_block_path(const char *path) {
+    for (int i = 0; i < wd.block_quantity; i++) {
+        if (!is_virtual_block(&wd.blocks[i]) && equal_strings(wd.blocks[i].path, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// watches exactly the directories listed in the blocks
+void sync_dir_watches(void) {
+    if (ev.watch_fd < 0) {
         return;
     }
+    for (int i = ev.n_watches - 1; i >= 0; i--) {
+        if (!is_block_path(ev.watches[i].path)) {
+            remove_dir_watch(i);
+        }
+    }
+    for (int i = 0; i < wd.block_quantity && ev.n_watches < MAX_DIR_WATCHES; i++) {
+        struct dirblock *block = &wd.blocks[i];
+        bool watched = false;
+        for (int j = 0; j < ev.n_watches && !watched; j++) {
+            watched = equal_strings(ev.watches[j].path, block->path);
+        }
+        if (!watched && !is_virtual_block(block)) {
+            add_dir_watch(block->path);
+        }
+    }
+}
+
+// Watched directories are re-listed by a worker. Events within
+// WATCH_DEBOUNCE_MS of the first one are coalesced, so a burst of changes
+// costs one listing per directory and input is never held up by it.
+
+#define WATCH_DEBOUNCE_MS 100
+
+struct relister
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *paths[MAX_DIR_WATCHES];   // changed directories waiting for the worker
+    int n_paths;
+    int64_t due;                    // when the worker may list them
+    struct dirblock fresh[MAX_DIR_WATCHES];    // listings waiting for the main loop
+    int n_fresh;
+};
+
+struct relister rl;
+
+void *relist_worker(void *arg) {
+    pthread_mutex_lock(&rl.lock);
+    while (1) {
+        while (rl.n_paths == 0) {
+            pthread_cond_wait(&rl.cond, &rl.lock);
+        }
+        int64_t wait = rl.due - get_monotonic_ns();
+        if (wait > 0) {
+            pthread_mutex_unlock(&rl.lock);
+            usleep(wait / 1000);
+            pthread_mutex_lock(&rl.lock);
+        }
+
+        char *paths[MAX_DIR_WATCHES];
+        int n_paths = rl.n_paths;
+        memcpy(paths, rl.paths, sizeof(char *) * n_paths);
+        rl.n_paths = 0;
+        pthread_mutex_unlock(&rl.lock);
+
+        for (int i = 0; i < n_paths; i++) {
+            struct dirblock fresh = get_dirblock(paths[i], 0);
+            pthread_mutex_lock(&rl.lock);
+            int slot = 0;
+            while (slot < rl.n_fresh && !equal_strings(rl.fresh[slot].path, paths[i])) {
+                slot++;
+            }
+            if (slot < rl.n_fresh) {
+                // an older listing of the same directory nobody took yet
+                free(rl.fresh[slot].path);
+                free_files(rl.fresh[slot].files, rl.fresh[slot].n_files);
+            } else {
+                rl.n_fresh++;
+            }
+            rl.fresh[slot] = fresh;
+            pthread_mutex_unlock(&rl.lock);
+        }
+        wake_main_loop();
+        pthread_mutex_lock(&rl.lock);
+    }
+    return NULL;
+}
+
+void start_relister(void) {
+    pthread_mutex_init(&rl.lock, NULL);
+    pthread_cond_init(&rl.cond, NULL);
+    if (pthread_create(&rl.thread, NULL, relist_worker, NULL) == 0) {
+        pthread_detach(rl.thread);
+    }
+}
+
+// asks for path to be listed again once its events have settled
+void queue_relist(const char *path) {
+    pthread_mutex_lock(&rl.lock);
+    for (int i = 0; i < rl.n_paths; i++) {
+        if (equal_strings(rl.paths[i], path)) {
+            pthread_mutex_unlock(&rl.lock);
+            return;
+        }
+    }
+    if (rl.n_paths == 0) {
+        rl.due = get_monotonic_ns() + WATCH_DEBOUNCE_MS * 1000000LL;
+    }
+    if (rl.n_paths < MAX_DIR_WATCHES) {
+        rl.paths[rl.n_paths++] = strdup(path);
+        pthread_cond_signal(&rl.cond);
+    }
+    pthread_mutex_unlock(&rl.lock);
+}
+
+// takes the listings the relister finished, true when a block changed
+bool adopt_relisted_blocks(void) {
+    bool adopted = false;
+
+    pthread_mutex_lock(&rl.lock);
+    for (int r = 0; r < rl.n_fresh; r++) {
+        struct dirblock *fresh = &rl.fresh[r];
+        bool used = false;
+        for (int i = 0; i < wd.block_quantity && !used; i++) {
+            if (!is_virtual_block(&wd.blocks[i]) && equal_strings(wd.blocks[i].path, fresh->path)) {
+                adopt_block_listing(i, fresh);
+                used = true;
+            }
+        }
+        if (!used) {
+            free_files(fresh->files, fresh->n_files);
+        }
+        free(fresh->path);
+        adopted |= used;
+    }
+    rl.n_fresh = 0;
+    pthread_mutex_unlock(&rl.lock);
+    return adopted;
+}
+
+// Drains the pending notifications and hands each changed directory to
+// the relister once, however many events it got.
+void queue_watched_blocks(void) {
+    bool changed[MAX_DIR_WATCHES] = {false};
+
+#if defined(__linux__)
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(ev.watch_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + len; ) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            for (int i = 0; i < ev.n_watches; i++) {
+                changed[i] |= ev.watches[i].id == event->wd;
+            }
+            // any event may be the followed file being rotated or appended to
+            fl.pending = fl.path != NULL;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#else
+    struct kevent events[16];
+    struct timespec zero = {0, 0};
+    int n;
+    while ((n = kevent(ev.watch_fd, NULL, 0, events, 16, &zero)) > 0) {
+        for (int e = 0; e < n; e++) {
+            for (int i = 0; i < ev.n_watches; i++) {
+                changed[i] |= ev.watches[i].id == (int) events[e].ident;
+            }
+            fl.pending = fl.path != NULL;
+        }
+    }
+#endif
+
+    for (int w = 0; w < ev.n_watches; w++) {
+        if (changed[w]) {
+            queue_relist(ev.watches[w].path);
+        }
+    }
+}
+
+void start_window(char *path)
+{
+    wd.moving_file = false;
+    wd.revalidating = false;
+    wd.term_height = bn.screen ? LINES : get_term_height();
+    wd.term_width = bn.screen ? COLS : get_term_width();
+    wd.top_bar_row = 0;
+    wd.box_row = 1;
+    wd.bottom_bar_row = wd.term_height - 1;
+    wd.block_quantity = 0;
+    wd.path = path;
+    start_prefetch();
+    start_relister();
+    if (load_session(path)) {
+        start_revalidation();
+    } else {
+        add_block();
+    }
+}
 
+void show_message_bottom_bar(const char *message) {
     move(wd.bottom_bar_row, 0);
     clrtoeol();
 
-    if (deleted) {
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "%s, press any key to continue", message);
+    attroff(COLOR_PAIR(2));
+    read_key();
+}
+
+// Reads a line of input in the bottom bar. Returns NULL when the input is
+// empty or cancelled with escape.
+char *read_input_bar(const char *message) {
+    int ch;
+    int i = 0;
+    int max = wd.term_width - strlen(message) - 1;
+    char *input = calloc(wd.term_width + 1, sizeof(char));
+
+    while (1) {
+        move(wd.bottom_bar_row, 0);
+        clrtoeol();
         attron(COLOR_PAIR(2));
-        mvprintw(wd.bottom_bar_row, 0, "File deleted successfully, press any key to continue");
+        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, input);
         attroff(COLOR_PAIR(2));
-        *wd.current_block = get_dirblock(wd.current_block->path, wd.current_block->column);
+
+        ch = read_key();
+        if (ch == KEY_BACKSPACE || ch == K_BACKSPACE) {
+            if (i > 0) {
+                input[--i] = '\0';
+            }
+        } else if (ch == KEY_ENTER || ch == K_ENTER) {
+            break;
+        } else if (ch == 27) {
+            i = 0;
+            break;
+        } else if (ch >= 0x20 && ch < 0x100 && i < max) {
+            input[i++] = ch;
+        }
+    }
+
+    if (i == 0) {
+        free(input);
+        return NULL;
     }
-    getch();
+    input[i] = '\0';
+    return input;
 }
 
 bool copy_file(const char *src, const char *dest) {
@@ -735,179 +2479,5867 @@ bool copy_file(const char *src, const char *dest) {
     return true;
 }
 
-void move_bar(char *src) {
-    int ch;
-    ch = getch();
-    mvprintw(wd.bottom_bar_row, 0, "Are you sure you want to move the file [y/n]");
+// Trash: deleting is a rename into the freedesktop trash of the file's
+// filesystem, so it takes the same time for a file as for a whole tree.
+// Deletes, renames and moves are appended to a journal that 'u' walks back.
+// With --trash-max-age or --trash-max-size, a background thread empties
+// what the journal says mordred trashed once it is past those limits;
+// whatever other programs put in the trash is left alone.
 
-    if (ch == 'y' || ch == 'Y') {
-        copy_file(src, wd.current_block->path);
-    } else if (ch == 'n' || ch == 'N') {
-        show_message_bottom_bar("File will not be moved");
-    } else {
-        show_message_bottom_bar("Error moving file");
-    }
+#define PURGE_INTERVAL_S 3600
 
+struct trash_item
+{
+    char *path;             // under trash/files
+    time_t deleted;
+    int64_t size;
+};
+
+struct purger
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool enabled;
+    bool pending;
+    int max_age_days;       // 0 for no limit
+    int64_t max_bytes;      // 0 for no limit
+    struct trash_item *items;   // sizes measured by earlier passes
+    int n_items;
+};
+
+struct purger pg;
+
+struct journal_op
+{
+    char *op;               // delete, rename, move or exchange
+    char *from;
+    char *to;
+};
+
+// absolute form of path, resolving its directory but not the last
+// component, which may be a symlink that is the thing to trash
+char *absolute_path(const char *path) {
+    char *copy = strdup(path);
+    char *slash = strrchr(copy, '/');
+    const char *name = path;
+    char *dir;
+
+    if (slash != NULL) {
+        name = path + (slash - copy) + 1;
+        *slash = '\0';
+        dir = realpath(slash == copy ? "/" : copy, NULL);
+    } else {
+        dir = realpath(".", NULL);
+    }
+    free(copy);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    char *absolute = malloc(PATH_MAX);
+    snprintf(absolute, PATH_MAX, "%s/%s", equal_strings(dir, "/") ? "" : dir, name);
+    free(dir);
+    return absolute;
+}
+
+// path up to its last slash, "/" for entries of the root
+char *get_parent_path(const char *path) {
+    char *parent = strdup(path);
+    char *slash = strrchr(parent, '/');
+
+    if (slash == NULL) {
+        free(parent);
+        return strdup(".");
+    }
+    slash[slash == parent ? 1 : 0] = '\0';
+    return parent;
+}
+
+char *get_home_trash(void) {
+    const char *data = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    char *path = malloc(PATH_MAX);
+
+    if (data && data[0] != '\0') {
+        snprintf(path, PATH_MAX, "%s/Trash", data);
+    } else if (home) {
+        snprintf(path, PATH_MAX, "%s/.local/share/Trash", home);
+    } else {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+// creates trash with its files and info directories, refusing trashes
+// that are symlinks or belong to someone else
+bool make_trash_dir(const char *trash) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    mkdir(trash, 0700);
+    if (lstat(trash, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+        return false;
+    }
+    snprintf(path, PATH_MAX, "%s/files", trash);
+    mkdir(path, 0700);
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    snprintf(path, PATH_MAX, "%s/info", trash);
+    mkdir(path, 0700);
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// topmost directory above path that is still on dev
+char *find_mount_point(const char *path, dev_t dev) {
+    char *top = get_parent_path(path);
+    struct stat st;
+
+    while (!equal_strings(top, "/")) {
+        char *parent = get_parent_path(top);
+        if (stat(parent, &st) != 0 || st.st_dev != dev) {
+            free(parent);
+            break;
+        }
+        free(top);
+        top = parent;
+    }
+    return top;
+}
+
+// The home trash when path lives on the same filesystem, otherwise
+// $topdir/.Trash/$uid if an administrator set up a sticky .Trash, and
+// $topdir/.Trash-$uid as the last resort. Renames never cross devices.
+char *get_trash_dir(const char *path, dev_t dev) {
+    struct stat st;
+    char *trash = get_home_trash();
+
+    if (trash != NULL) {
+        make_parent_dirs(trash, 0700);
+        if (make_trash_dir(trash) && stat(trash, &st) == 0 && st.st_dev == dev) {
+            return trash;
+        }
+        free(trash);
+    }
+
+    char *top = find_mount_point(path, dev);
+    const char *prefix = equal_strings(top, "/") ? "" : top;
+    trash = malloc(PATH_MAX);
+
+    snprintf(trash, PATH_MAX, "%s/.Trash", prefix);
+    if (lstat(trash, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & S_ISVTX)) {
+        snprintf(trash, PATH_MAX, "%s/.Trash/%d", prefix, (int) getuid());
+        if (make_trash_dir(trash)) {
+            free(top);
+            return trash;
+        }
+    }
+    snprintf(trash, PATH_MAX, "%s/.Trash-%d", prefix, (int) getuid());
+    free(top);
+    if (make_trash_dir(trash)) {
+        return trash;
+    }
+    free(trash);
+    return NULL;
+}
+
+// the Path key of .trashinfo files is percent-encoded
+static void write_trash_uri(FILE *fp, const char *path) {
+    for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            *p == '/' || *p == '-' || *p == '_' || *p == '.' || *p == '~') {
+            fputc(*p, fp);
+        } else {
+            fprintf(fp, "%%%02X", *p);
+        }
+    }
+}
+
+// trash/files/name -> trash/info/name.trashinfo
+char *get_trash_info_path(const char *trashed) {
+    const char *name = strrchr(trashed, '/');
+    int trash_len = (name - trashed) - (int) strlen("/files");
+    char *info = malloc(PATH_MAX);
+
+    snprintf(info, PATH_MAX, "%.*s/info%s.trashinfo", trash_len, trashed, name);
+    return info;
+}
+
+void wake_purger(void) {
+    if (!pg.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&pg.lock);
+    pg.pending = true;
+    pthread_cond_signal(&pg.cond);
+    pthread_mutex_unlock(&pg.lock);
+}
+
+// Moves path into the trash of its filesystem and returns where it ended
+// up, or NULL when there is no usable trash. The info file is created
+// first and exclusively, which is what reserves a name in the trash.
+char *trash_file(const char *path) {
+    struct stat st;
+    char *absolute = absolute_path(path);
+
+    if (absolute == NULL || lstat(absolute, &st) != 0) {
+        free(absolute);
+        return NULL;
+    }
+    char *trash = get_trash_dir(absolute, st.st_dev);
+    if (trash == NULL) {
+        free(absolute);
+        return NULL;
+    }
+
+    const char *name = strrchr(absolute, '/') + 1;
+    char unique[NAME_MAX + 16];
+    char info[PATH_MAX];
+    char dest[PATH_MAX];
+    char *trashed = NULL;
+
+    for (int n = 1; n < 10000 && trashed == NULL; n++) {
+        if (n == 1) {
+            snprintf(unique, sizeof(unique), "%s", name);
+        } else {
+            snprintf(unique, sizeof(unique), "%s.%d", name, n);
+        }
+        snprintf(info, PATH_MAX, "%s/info/%s.trashinfo", trash, unique);
+        snprintf(dest, PATH_MAX, "%s/files/%s", trash, unique);
+
+        int fd = open(info, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            break;
+        }
+        if (lstat(dest, &st) == 0) {
+            // left behind without its info file, keep it
+            close(fd);
+            unlink(info);
+            continue;
+        }
+
+        char date[32];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+        FILE *fp = fdopen(fd, "w");
+        fprintf(fp, "[Trash Info]\nPath=");
+        write_trash_uri(fp, absolute);
+        fprintf(fp, "\nDeletionDate=%s\n", date);
+        if (fclose(fp) != 0 || rename(absolute, dest) != 0) {
+            unlink(info);
+            break;
+        }
+        trashed = strdup(dest);
+    }
+
+    free(trash);
+    free(absolute);
+    return trashed;
+}
+
+// rename, falling back to copy and unlink for a regular file that has to
+// change filesystem
+bool move_path(const char *src, const char *dest) {
+    struct stat st;
+
+    if (lstat(dest, &st) == 0) {
+        errno = EEXIST;
+        return false;
+    }
+    if (rename(src, dest) == 0) {
+        return true;
+    }
+    if (errno != EXDEV || lstat(src, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    return copy_file(src, dest) && unlink(src) == 0;
+}
+
+// swaps two names in one step where the system can
+static bool exchange_names(int dir_fd, const char *a, const char *b) {
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+    return renameat2(dir_fd, a, dir_fd, b, RENAME_EXCHANGE) == 0;
+#elif defined(__APPLE__) && defined(RENAME_SWAP)
+    return renameatx_np(dir_fd, a, dir_fd, b, RENAME_SWAP) == 0;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+// Renames from to to inside dir_fd, failing with EEXIST instead of
+// replacing a file that appeared under to in the meantime.
+static bool rename_no_replace(int dir_fd, const char *from, const char *to) {
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+    if (renameat2(dir_fd, from, dir_fd, to, RENAME_NOREPLACE) == 0) {
+        return true;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        return false;
+    }
+#elif defined(__APPLE__) && defined(RENAME_EXCL)
+    if (renameatx_np(dir_fd, from, dir_fd, to, RENAME_EXCL) == 0) {
+        return true;
+    }
+    if (errno != EINVAL && errno != ENOTSUP) {
+        return false;
+    }
+#endif
+    // a hard link cannot replace anything; directories only get a check
+    if (linkat(dir_fd, from, dir_fd, to, 0) == 0) {
+        return unlinkat(dir_fd, from, 0) == 0;
+    }
+    if (errno == EEXIST) {
+        return false;
+    }
+    if (faccessat(dir_fd, to, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
+        return false;
+    }
+    return renameat(dir_fd, from, dir_fd, to) == 0;
+}
+
+// journal fields are separated by tabs, so tabs, newlines and backslashes
+// inside paths are escaped
+static size_t escape_journal_field(char *out, const char *field) {
+    size_t n = 0;
+    for (; *field; field++) {
+        if (*field == '\t' || *field == '\n' || *field == '\\') {
+            out[n++] = '\\';
+            out[n++] = *field == '\t' ? 't' : (*field == '\n' ? 'n' : '\\');
+        } else {
+            out[n++] = *field;
+        }
+    }
+    return n;
+}
+
+static char *unescape_journal_field(const char *field) {
+    char *out = malloc(strlen(field) + 1);
+    size_t n = 0;
+    for (; *field; field++) {
+        if (*field == '\\' && field[1] != '\0') {
+            field++;
+            out[n++] = *field == 't' ? '\t' : (*field == 'n' ? '\n' : *field);
+        } else {
+            out[n++] = *field;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+// Appends one operation to the journal. The line goes out in a single
+// write on an O_APPEND descriptor, so a crash never leaves half of it.
+void journal_append(const char *op, const char *from, const char *to) {
+    char *path = get_state_path("journal");
+    if (path == NULL) {
+        return;
+    }
+    make_parent_dirs(path, 0700);
+
+    char *line = malloc(strlen(op) + 2 * (strlen(from) + strlen(to)) + 4);
+    size_t len = escape_journal_field(line, op);
+    line[len++] = '\t';
+    len += escape_journal_field(line + len, from);
+    line[len++] = '\t';
+    len += escape_journal_field(line + len, to);
+    line[len++] = '\n';
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd >= 0) {
+        if (write(fd, line, len) != (ssize_t) len) {
+            show_message_bottom_bar("Could not write to the journal");
+        }
+        close(fd);
+    }
+    free(line);
+    free(path);
+}
+
+void free_journal_op(struct journal_op *op) {
+    free(op->op);
+    free(op->from);
+    free(op->to);
+}
+
+// Replays the journal as a stack where every "undo" line pops the
+// operation it reverted, leaving the operations still standing, oldest
+// first. Returns how many there are.
+int read_journal(struct journal_op **standing) {
+    char *path = get_state_path("journal");
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    free(path);
+    *standing = NULL;
+    if (fp == NULL) {
+        return 0;
+    }
+
+    struct journal_op *ops = NULL;
+    int n_ops = 0, cap = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, fp)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        char *rest = line;
+        char *op = strsep(&rest, "\t");
+        char *from = strsep(&rest, "\t");
+        char *to = strsep(&rest, "\t");
+        if (from == NULL || to == NULL) {
+            continue;
+        }
+        if (equal_strings(op, "undo")) {
+            if (n_ops > 0) {
+                free_journal_op(&ops[--n_ops]);
+            }
+            continue;
+        }
+        if (n_ops == cap) {
+            cap = cap ? cap * 2 : 64;
+            ops = realloc(ops, sizeof(struct journal_op) * cap);
+        }
+        ops[n_ops++] = (struct journal_op){strdup(op), unescape_journal_field(from), unescape_journal_field(to)};
+    }
+    free(line);
+    fclose(fp);
+    *standing = ops;
+    return n_ops;
+}
+
+// the last operation of the journal that has not been undone yet
+bool journal_last(struct journal_op *last) {
+    struct journal_op *ops;
+    int n_ops = read_journal(&ops);
+
+    if (n_ops > 0) {
+        *last = ops[--n_ops];
+    }
+    for (int i = 0; i < n_ops; i++) {
+        free_journal_op(&ops[i]);
+    }
+    free(ops);
+    return last->op != NULL;
+}
+
+// re-lists every block showing dir after an operation changed it
+void refresh_blocks_in(const char *dir) {
+    struct stat target, st;
+
+    if (stat(dir, &target) != 0) {
+        return;
+    }
+    for (int i = 0; i < wd.block_quantity; i++) {
+        struct dirblock *block = &wd.blocks[i];
+        if (is_virtual_block(block) || stat(block->path, &st) != 0) {
+            continue;
+        }
+        if (st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            struct dirblock fresh = get_dirblock(block->path, block->column);
+            adopt_block_listing(i, &fresh);
+        }
+    }
+}
+
+// reverts the last operation of the journal that has not been undone yet
+void undo_bar() {
+    struct journal_op last = {0};
+    char message[PATH_MAX + 64];
+
+    if (!journal_last(&last)) {
+        show_message_bottom_bar("Nothing to undo");
+        return;
+    }
+
+    move(wd.bottom_bar_row, 0);
+    clrtoeol();
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Undo %s of %s? [y/n]", last.op, strrchr(last.from, '/') + 1);
+    attroff(COLOR_PAIR(2));
+
+    int ch = read_key();
+    if (ch == 'y' || ch == 'Y') {
+        bool exchange = equal_strings(last.op, "exchange");
+        if (exchange ? exchange_names(AT_FDCWD, last.from, last.to) : move_path(last.to, last.from)) {
+            if (equal_strings(last.op, "delete")) {
+                char *info = get_trash_info_path(last.to);
+                unlink(info);
+                free(info);
+            }
+            journal_append("undo", last.from, last.to);
+
+            char *from_dir = get_parent_path(last.from);
+            char *to_dir = get_parent_path(last.to);
+            refresh_blocks_in(from_dir);
+            refresh_blocks_in(to_dir);
+            free(from_dir);
+            free(to_dir);
+            snprintf(message, sizeof(message), "Undid %s of %s", last.op, strrchr(last.from, '/') + 1);
+        } else if (errno == EEXIST) {
+            snprintf(message, sizeof(message), "Could not undo: %s already exists", last.from);
+        } else {
+            snprintf(message, sizeof(message), "Could not undo: %s is gone", last.to);
+        }
+        show_message_bottom_bar(message);
+    }
+    free_journal_op(&last);
+}
+
+// size of a trashed file or tree
+int64_t get_tree_size(const char *path) {
+    struct stat st;
+    struct walker w;
+    int64_t size = 0;
+
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return st.st_size;
+    }
+    parallel_walk(&w, path, false);
+    for (int i = 0; i < w.n_files; i++) {
+        size += w.files[i].size;
+    }
+    free_walk_files(w.files, w.n_files);
+    return size;
+}
+
+struct unlink_job
+{
+    int root_fd;
+    struct walk_file *files;
+    int n_files;
+    int next;
+};
+
+static void *unlink_worker(void *arg) {
+    struct unlink_job *job = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_files) {
+        if (!S_ISDIR(job->files[i].mode)) {
+            unlinkat(job->root_fd, job->files[i].path, 0);
+        }
+    }
+    return NULL;
+}
+
+// deepest directories first, so each one is empty when its turn comes
+static int compare_depth(const void *a, const void *b) {
+    const struct walk_file *x = a, *y = b;
+    int depth_x = 0, depth_y = 0;
+    for (const char *p = x->path; *p; p++) {
+        depth_x += *p == '/';
+    }
+    for (const char *p = y->path; *p; p++) {
+        depth_y += *p == '/';
+    }
+    return depth_y - depth_x;
+}
+
+// empties dir of what the walk does not report (symlinks, sockets...)
+// and removes it
+static void remove_emptied_dir(int root_fd, const char *path) {
+    int fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    struct dirent *entry;
+
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (!equal_strings(entry->d_name, ".") && !equal_strings(entry->d_name, "..")) {
+                unlinkat(dirfd(dir), entry->d_name, 0);
+            }
+        }
+        closedir(dir);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    unlinkat(root_fd, path, AT_REMOVEDIR);
+}
+
+// Removes a tree: files are unlinked by a pool of threads, then the
+// directories are removed bottom up.
+void remove_tree(const char *path) {
+    struct stat st;
+    struct walker w;
+
+    if (lstat(path, &st) != 0) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        unlink(path);
+        return;
+    }
+
+    parallel_walk(&w, path, true);
+    struct unlink_job job = {open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW), w.files, w.n_files, 0};
+    if (job.root_fd >= 0) {
+        int n_threads = get_worker_count();
+        pthread_t threads[n_threads];
+        for (int i = 0; i < n_threads; i++) {
+            pthread_create(&threads[i], NULL, unlink_worker, &job);
+        }
+        for (int i = 0; i < n_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        qsort(w.files, w.n_files, sizeof(struct walk_file), compare_depth);
+        for (int i = 0; i < w.n_files; i++) {
+            if (S_ISDIR(w.files[i].mode)) {
+                remove_emptied_dir(job.root_fd, w.files[i].path);
+            }
+        }
+        remove_emptied_dir(job.root_fd, ".");
+        close(job.root_fd);
+    }
+    free_walk_files(w.files, w.n_files);
+    rmdir(path);
+}
+
+static int compare_trash_items(const void *a, const void *b) {
+    const struct trash_item *x = a, *y = b;
+    return x->deleted < y->deleted ? -1 : (x->deleted > y->deleted);
+}
+
+static int compare_trash_paths(const void *a, const void *b) {
+    const struct trash_item *x = a, *y = b;
+    return strcmp(x->path, y->path);
+}
+
+// DeletionDate of an info file, its mtime when the key is missing
+time_t read_deletion_date(const char *info) {
+    struct stat st;
+    struct tm tm = {0};
+    time_t deleted = 0;
+    char *line = NULL;
+    size_t size = 0;
+    FILE *fp = fopen(info, "r");
+
+    if (fp == NULL) {
+        return 0;
+    }
+    while (getline(&line, &size, fp) > 0) {
+        if (strncmp(line, "DeletionDate=", 13) == 0 && strptime(line + 13, "%Y-%m-%dT%H:%M:%S", &tm) != NULL) {
+            tm.tm_isdst = -1;
+            deleted = mktime(&tm);
+            break;
+        }
+    }
+    if (deleted == 0 && fstat(fileno(fp), &st) == 0) {
+        deleted = st.st_mtime;
+    }
+    free(line);
+    fclose(fp);
+    return deleted;
+}
+
+// Empties the trash of what mordred deleted and was not undone: first
+// what is older than the age limit, then the oldest items until the rest
+// fits in the size limit. Each item is measured once, on the first pass
+// that sees it.
+void purge_trash(void) {
+    struct journal_op *ops;
+    int n_ops = read_journal(&ops);
+    struct trash_item *items = malloc(sizeof(struct trash_item) * (n_ops > 0 ? n_ops : 1));
+    int n_items = 0;
+    int64_t total = 0;
+    struct stat st;
+
+    for (int i = 0; i < n_ops; i++) {
+        if (equal_strings(ops[i].op, "delete") && lstat(ops[i].to, &st) == 0) {
+            struct trash_item key = {ops[i].to};
+            struct trash_item *known = bsearch(&key, pg.items, pg.n_items, sizeof(struct trash_item),
+                                               compare_trash_paths);
+            struct trash_item *item = &items[n_items++];
+            if (known != NULL) {
+                *item = *known;
+                known->path = NULL;
+            } else {
+                char *info = get_trash_info_path(ops[i].to);
+                *item = (struct trash_item){strdup(ops[i].to), read_deletion_date(info), get_tree_size(ops[i].to)};
+                free(info);
+            }
+            total += item->size;
+        }
+        free_journal_op(&ops[i]);
+    }
+    free(ops);
+    for (int i = 0; i < pg.n_items; i++) {
+        free(pg.items[i].path);
+    }
+    free(pg.items);
+
+    qsort(items, n_items, sizeof(struct trash_item), compare_trash_items);
+    time_t now = time(NULL);
+    int kept = 0;
+    for (int i = 0; i < n_items; i++) {
+        if ((pg.max_age_days > 0 && now - items[i].deleted > pg.max_age_days * 86400LL) ||
+            (pg.max_bytes > 0 && total > pg.max_bytes)) {
+            remove_tree(items[i].path);
+            char *info = get_trash_info_path(items[i].path);
+            unlink(info);
+            free(info);
+            free(items[i].path);
+            total -= items[i].size;
+        } else {
+            items[kept++] = items[i];
+        }
+    }
+    qsort(items, kept, sizeof(struct trash_item), compare_trash_paths);
+    pg.items = items;
+    pg.n_items = kept;
+}
+
+// purges an hour after startup and every hour since, or right after a
+// delete
+void *purge_worker(void *arg) {
+    set_low_priority();
+
+    pthread_mutex_lock(&pg.lock);
+    while (1) {
+        if (!pg.pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += PURGE_INTERVAL_S;
+            pthread_cond_timedwait(&pg.cond, &pg.lock, &deadline);
+        }
+        pg.pending = false;
+        pthread_mutex_unlock(&pg.lock);
+
+        purge_trash();
+
+        pthread_mutex_lock(&pg.lock);
+    }
+    return NULL;
+}
+
+// starts the purger when a limit was given
+void start_purger(int max_age_days, int64_t max_bytes) {
+    if (max_age_days <= 0 && max_bytes <= 0) {
+        return;
+    }
+    pthread_mutex_init(&pg.lock, NULL);
+    pthread_cond_init(&pg.cond, NULL);
+    pg.max_age_days = max_age_days;
+    pg.max_bytes = max_bytes;
+    if (pthread_create(&pg.thread, NULL, purge_worker, NULL) == 0) {
+        pthread_detach(pg.thread);
+        pg.enabled = true;
+    }
+}
+
+// Moves path to the trash. Only when its filesystem has no usable trash
+// is a regular file offered to be deleted for good.
+bool delete_file(const char *path) {
+    struct stat st;
+    
+    if (lstat(path, &st) != 0) {
+        if (errno == ENOENT) {
+            show_message_bottom_bar("Could not delete: file does not exist!");
+        } else {
+            show_message_bottom_bar("Could not delete: error verifying file");
+        }
+        return false;
+    }
+
+    char *absolute = absolute_path(path);
+    char *trashed = trash_file(path);
+    if (trashed != NULL) {
+        journal_append("delete", absolute, trashed);
+        wake_purger();
+        free(trashed);
+        free(absolute);
+        return true;
+    }
+    free(absolute);
+    
+    if (!S_ISREG(st.st_mode)) {
+        show_message_bottom_bar("Could not delete: no trash on this filesystem");
+        return false;
+    }
+
+    move(wd.bottom_bar_row, 0);
+    clrtoeol();
+    attron(COLOR_PAIR(3));
+    mvprintw(wd.bottom_bar_row, 0, "No trash on this filesystem, delete it for good? [y/n]");
+    attroff(COLOR_PAIR(3));
+    int ch = read_key();
+    if (ch != 'y' && ch != 'Y') {
+        return false;
+    }
+    
+    if (remove(path) == 0) {
+        return true;
+    } else {
+        show_message_bottom_bar("Could not delete: error deleting file");
+        return false;
+    }
+}
+
+bool create_file(char *filename) {
+    FILE *file;
+    char *path = get_new_path(wd.current_block->path, filename);
+
+    if (path == NULL) {
+        show_message_bottom_bar("Error, could not create new file");
+        return false;
+    }
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        show_message_bottom_bar("Error, could not create new file");
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+void new_file_bar() {
+    int ch;
+    char *new_name = malloc(wd.term_width * sizeof(char));
+    char message[] = "New file name: ";
+    int message_len = strlen(message);
+    int column = message_len;
+    int i = 0;
+
+    while (1) {   
+        move(wd.bottom_bar_row, 0);
+        clrtoeol();
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, new_name);
+        attroff(COLOR_PAIR(2));
+
+        ch = read_key();
+
+        if (ch == KEY_BACKSPACE || ch == 127) {
+            if (column > message_len) {
+                i--;
+                new_name[i] = '\0';
+                column--;
+                mvaddch(wd.bottom_bar_row, column, ' ');
+                move(wd.bottom_bar_row, column);
+            } 
+            continue;
+        } else if (ch == KEY_ENTER || ch == K_ENTER) {
+            if (column > message_len) {
+                break;
+            } else {
+                show_message_bottom_bar("Filename cannot be empty");
+                continue;
+            }
+        }
+
+        attron(COLOR_PAIR(2));
+        mvaddch(wd.bottom_bar_row, column++, ch);
+        attroff(COLOR_PAIR(2));
+        new_name[i++] = ch;  
+        if (column >= wd.term_width - 1) {
+            break;
+        }
+    }
+
+    new_name[i] = '\0';
+
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Create file %s? [y/n]", new_name);
+    attroff(COLOR_PAIR(2));
+    ch = read_key();
+    if (ch == 'y' || ch == 'Y') {
+        if (create_file(new_name)) {
+            refresh_blocks_in(wd.current_block->path);
+            show_message_bottom_bar("File created successfully");
+        } else {
+            show_message_bottom_bar("There was an error creating the file");
+        }
+        free(new_name);
+    } else {
+        show_message_bottom_bar("File will not be created");
+    }
+}
+
+// deletes the selection of a directory or a duplicates block
+void delete_bar() {
+    int ch;
+    bool deleted = false;
+
+    if (wd.current_block->archive) {
+        show_message_bottom_bar("Archives are read-only");
+        return;
+    }
+    if (wd.current_block->comparison) {
+        show_message_bottom_bar("Files cannot be deleted here");
+        return;
+    }
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Are you sure you want to delete the file %s? [y/n]", wd.current_block->selected);
+    attroff(COLOR_PAIR(2));
+
+    ch = read_key();
+    if (ch == 'y' || ch == 'Y') {
+        char *path = get_new_path(wd.current_block->path, wd.current_block->selected);
+        if (path == NULL) {
+            show_message_bottom_bar("Could not delete: error deleting file");
+            return;
+        }
+        deleted = delete_file(path);
+        free(path);
+    } else if (ch == 'n' || ch == 'N') {
+        return;
+    } else {
+        show_message_bottom_bar("Wrong option selected: file will not be deleted");
+        return;
+    }
+
+    move(wd.bottom_bar_row, 0);
+    clrtoeol();
+
+    if (deleted) {
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "File moved to the trash (u to undo), press any key to continue");
+        attroff(COLOR_PAIR(2));
+        if (wd.current_block->duplicates) {
+            remove_block_entry(wd.current_block, wd.current_block->selected_index);
+        } else {
+            refresh_blocks_in(wd.current_block->path);
+        }
+    }
+    read_key();
+}
+
+void move_bar(char *src) {
+    int ch;
+    ch = read_key();
+    mvprintw(wd.bottom_bar_row, 0, "Are you sure you want to move the file [y/n]");
+
+    if (ch == 'y' || ch == 'Y') {
+        copy_file(src, wd.current_block->path);
+    } else if (ch == 'n' || ch == 'N') {
+        show_message_bottom_bar("File will not be moved");
+    } else {
+        show_message_bottom_bar("Error moving file");
+    }
+
+}
+
+bool rename_file(char *current_name, char *new_name) {
+    struct stat st;
+
+    char *current_path = get_new_path(wd.current_block->path, current_name);
+    char *new_path = get_new_path(wd.current_block->path, new_name);
+
+    if (current_path == NULL) {
+        show_message_bottom_bar("Could not rename file: error finding current path");
+        return false;
+    }
+
+    if (new_path == NULL) {
+        show_message_bottom_bar("Could not rename file: error finding new path");
+        return false;
+    }
+
+    if (stat(current_path, &st) != 0) {
+        if (errno == ENOENT) {
+            show_message_bottom_bar("Could not rename file: file does not exist!");
+        } else {
+            show_message_bottom_bar("Could not rename file: error verifying file");
+        }
+        return false;
+    }
+
+    if (stat(new_path, &st) == 0) {
+        show_message_bottom_bar("Could not rename file: file already exist!");
+        return false;
+    }
+
+    if (rename(current_path, new_path) == 0) {
+        char *absolute_current = absolute_path(current_path);
+        char *absolute_new = absolute_path(new_path);
+        if (absolute_current != NULL && absolute_new != NULL) {
+            journal_append("rename", absolute_current, absolute_new);
+        }
+        free(absolute_current);
+        free(absolute_new);
+        show_message_bottom_bar("File renamed!");
+        return true;
+    } else {
+        show_message_bottom_bar("Error renaming file");
+        return false;
+    }
+
+}
+
+void rename_bar() {
+    int ch;
+    char *new_name = malloc(wd.term_width * sizeof(char));
+    char message[] = "New name: ";
+    int message_len = strlen(message);
+    int column = message_len;
+    int i = 0;
+
+    while (1) {   
+        move(wd.bottom_bar_row, 0);
+        clrtoeol();
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, new_name);
+        attroff(COLOR_PAIR(2));
+
+        ch = read_key();
+
+        if (ch == KEY_BACKSPACE || ch == 127) {
+            if (column > message_len) {
+                i--;
+                new_name[i] = '\0';
+                column--;
+                mvaddch(wd.bottom_bar_row, column, ' ');
+                move(wd.bottom_bar_row, column);
+            } 
+            continue;
+        } else if (ch == KEY_ENTER || ch == K_ENTER) {
+            if (column > message_len) {
+                break;
+            } else {
+                show_message_bottom_bar("Filename cannot be empty");
+                continue;
+            }
+        }
+
+        attron(COLOR_PAIR(2));
+        mvaddch(wd.bottom_bar_row, column++, ch);
+        attroff(COLOR_PAIR(2));
+        new_name[i++] = ch;  
+        if (column >= wd.term_width - 1) {
+            break;
+        }
+    }
+
+    new_name[i] = '\0';
+
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Rename file as %s? [y/n]", new_name);
+    attroff(COLOR_PAIR(2));
+    ch = read_key();
+    if (ch == 'y' || ch == 'Y') {
+        if (rename_file(wd.current_block->selected, new_name)) {
+            refresh_blocks_in(wd.current_block->path);
+        } else {
+            show_message_bottom_bar("There was an error renaming the file");
+        }
+        free(new_name);
+    } else {
+        show_message_bottom_bar("File will not be renamed");
+    }
+}
+
+// Bulk rename over the marked entries of a block, or all of them. The
+// input is either s/regex/replacement/[gi], where & and \1..\9 refer to
+// the match, or a template where {n} is the position in the batch ({n:3}
+// zero padded), {name} the name without its extension and {ext} the
+// extension.
+
+#define RENAME_INPUT_MAX 256
+
+struct rename_pattern
+{
+    bool is_regex;
+    regex_t regex;
+    char *replacement;          // the template when not a regex
+    bool global;
+};
+
+struct rename_item
+{
+    int index;                  // entry in the block
+    char *new_name;             // NULL when the name stays the same
+    int next;                   // item whose current name new_name takes, -1 if free
+    bool conflict;
+    bool done;
+};
+
+static void append_bytes(char **out, size_t *len, size_t *cap, const char *s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        *cap = (*len + n + 1) * 2;
+        *out = realloc(*out, *cap);
+    }
+    memcpy(*out + *len, s, n);
+    *len += n;
+    (*out)[*len] = '\0';
+}
+
+// Splits s<d>regex<d>replacement<d>flags. Anything that is not shaped like
+// that is taken as a template. Returns false with error set when the
+// regex does not compile.
+bool parse_rename_pattern(const char *input, struct rename_pattern *p, char *error, size_t error_size) {
+    char delim = input[0] == 's' ? input[1] : '\0';
+    char *parts[3] = {NULL, NULL, NULL};
+    size_t lens[3] = {0, 0, 0}, caps[3] = {0, 0, 0};
+    int n_parts = 0;
+
+    memset(p, 0, sizeof(*p));
+    if (delim != '\0' && delim != '\\' && delim != ' ' && strchr("{}", delim) == NULL &&
+        !(delim >= 'a' && delim <= 'z') && !(delim >= 'A' && delim <= 'Z') && !(delim >= '0' && delim <= '9')) {
+        for (int i = 0; i < 3; i++) {
+            append_bytes(&parts[i], &lens[i], &caps[i], "", 0);
+        }
+        for (const char *c = input + 2; *c; c++) {
+            if (*c == delim) {
+                if (++n_parts == 3) {
+                    break;
+                }
+            } else if (n_parts < 3 && *c == '\\' && c[1] == delim) {
+                append_bytes(&parts[n_parts], &lens[n_parts], &caps[n_parts], c + 1, 1);
+                c++;
+            } else if (n_parts < 3) {
+                append_bytes(&parts[n_parts], &lens[n_parts], &caps[n_parts], c, 1);
+            }
+        }
+    }
+
+    if (n_parts < 2) {
+        for (int i = 0; i < 3; i++) {
+            free(parts[i]);
+        }
+        p->replacement = strdup(input);
+        return true;
+    }
+
+    int cflags = REG_EXTENDED;
+    for (const char *f = parts[2]; *f; f++) {
+        if (*f == 'g') {
+            p->global = true;
+        } else if (*f == 'i') {
+            cflags |= REG_ICASE;
+        } else {
+            snprintf(error, error_size, "unknown flag %c", *f);
+            free(parts[0]);
+            free(parts[1]);
+            free(parts[2]);
+            return false;
+        }
+    }
+    int rc = regcomp(&p->regex, parts[0], cflags);
+    if (rc != 0) {
+        regerror(rc, &p->regex, error, error_size);
+        free(parts[0]);
+        free(parts[1]);
+        free(parts[2]);
+        return false;
+    }
+    p->is_regex = true;
+    p->replacement = parts[1];
+    free(parts[0]);
+    free(parts[2]);
+    return true;
+}
+
+void free_rename_pattern(struct rename_pattern *p) {
+    if (p->is_regex) {
+        regfree(&p->regex);
+    }
+    free(p->replacement);
+}
+
+char *regex_substitute(struct rename_pattern *p, const char *name) {
+    char *out = NULL;
+    size_t len = 0, cap = 0;
+    const char *s = name;
+    regmatch_t m[10];
+    int eflags = 0;
+
+    append_bytes(&out, &len, &cap, "", 0);
+    while (regexec(&p->regex, s, 10, m, eflags) == 0) {
+        append_bytes(&out, &len, &cap, s, m[0].rm_so);
+        for (const char *r = p->replacement; *r; r++) {
+            int group = -1;
+            if (*r == '&') {
+                group = 0;
+            } else if (*r == '\\' && r[1] >= '0' && r[1] <= '9') {
+                group = *++r - '0';
+            } else if (*r == '\\' && r[1] != '\0') {
+                r++;
+            }
+            if (group < 0) {
+                append_bytes(&out, &len, &cap, r, 1);
+            } else if (m[group].rm_so >= 0) {
+                append_bytes(&out, &len, &cap, s + m[group].rm_so, m[group].rm_eo - m[group].rm_so);
+            }
+        }
+        if (m[0].rm_eo == m[0].rm_so) {
+            // an empty match moves on by one character
+            if (s[m[0].rm_eo] == '\0') {
+                s += m[0].rm_eo;
+                break;
+            }
+            append_bytes(&out, &len, &cap, s + m[0].rm_eo, 1);
+            s += m[0].rm_eo + 1;
+        } else {
+            s += m[0].rm_eo;
+        }
+        eflags = REG_NOTBOL;
+        if (!p->global) {
+            break;
+        }
+    }
+    append_bytes(&out, &len, &cap, s, strlen(s));
+    return out;
+}
+
+char *expand_template(const char *template, const char *name, int seq) {
+    const char *dot = strrchr(name, '.');
+    char *out = NULL;
+    size_t len = 0, cap = 0;
+    char number[32];
+    int width;
+
+    if (dot == name) {
+        dot = NULL; // hidden files have no extension
+    }
+    append_bytes(&out, &len, &cap, "", 0);
+    for (const char *t = template; *t; t++) {
+        // %n is only stored once the closing brace matched
+        int used = 0;
+        if (strncmp(t, "{name}", 6) == 0) {
+            append_bytes(&out, &len, &cap, name, dot ? (size_t) (dot - name) : strlen(name));
+            t += 5;
+        } else if (strncmp(t, "{ext}", 5) == 0) {
+            append_bytes(&out, &len, &cap, dot ? dot + 1 : "", dot ? strlen(dot + 1) : 0);
+            t += 4;
+        } else if (strncmp(t, "{n}", 3) == 0) {
+            append_bytes(&out, &len, &cap, number, snprintf(number, sizeof(number), "%d", seq));
+            t += 2;
+        } else if (sscanf(t, "{n:%d}%n", &width, &used) == 1 && used > 0 && width >= 0 && width < 20) {
+            append_bytes(&out, &len, &cap, number, snprintf(number, sizeof(number), "%0*d", width, seq));
+            t += used - 1;
+        } else {
+            append_bytes(&out, &len, &cap, t, 1);
+        }
+    }
+    return out;
+}
+
+static int compare_new_names(const void *a, const void *b) {
+    return strcmp((*(struct rename_item *const *) a)->new_name, (*(struct rename_item *const *) b)->new_name);
+}
+
+// Works out every new name and flags the invalid ones and the collisions,
+// with each other or with entries that stay. A new name taken by another
+// entry of the batch is fine: that rename just has to go first. Returns
+// the number of conflicts.
+int plan_bulk_rename(struct dirblock *block, struct rename_item *items, int n_items,
+                     struct rename_pattern *p, int *n_changes) {
+    int *item_of = malloc(sizeof(int) * (block->n_files > 0 ? block->n_files : 1));
+    struct rename_item **sorted = malloc(sizeof(struct rename_item *) * (n_items > 0 ? n_items : 1));
+    int n_sorted = 0;
+    int n_conflicts = 0;
+
+    for (int i = 0; i < block->n_files; i++) {
+        item_of[i] = -1;
+    }
+    for (int i = 0; i < n_items; i++) {
+        struct rename_item *item = &items[i];
+        const char *name = block->files[item->index].name;
+        free(item->new_name);
+        item->new_name = p->is_regex ? regex_substitute(p, name) : expand_template(p->replacement, name, i + 1);
+        item->next = -1;
+        item->conflict = false;
+        item->done = false;
+        if (equal_strings(item->new_name, name)) {
+            free(item->new_name);
+            item->new_name = NULL;
+            continue;
+        }
+        item_of[item->index] = i;
+        sorted[n_sorted++] = item;
+        if (item->new_name[0] == '\0' || strchr(item->new_name, '/') != NULL ||
+            equal_strings(item->new_name, ".") || equal_strings(item->new_name, "..")) {
+            item->conflict = true;
+        }
+    }
+
+    qsort(sorted, n_sorted, sizeof(struct rename_item *), compare_new_names);
+    for (int i = 1; i < n_sorted; i++) {
+        if (equal_strings(sorted[i - 1]->new_name, sorted[i]->new_name)) {
+            sorted[i - 1]->conflict = true;
+            sorted[i]->conflict = true;
+        }
+    }
+
+    for (int i = 0; i < n_sorted; i++) {
+        struct entry key = {sorted[i]->new_name};
+        struct entry *hit = bsearch(&key, block->files, block->n_files, sizeof(struct entry), compare_entries);
+        if (hit != NULL) {
+            int taken_by = item_of[hit - block->files];
+            if (taken_by < 0) {
+                sorted[i]->conflict = true;
+            } else {
+                sorted[i]->next = taken_by;
+            }
+        }
+        n_conflicts += sorted[i]->conflict;
+    }
+
+    *n_changes = n_sorted;
+    free(sorted);
+    free(item_of);
+    return n_conflicts;
+}
+
+struct bulk_rename
+{
+    struct dirblock *block;
+    struct rename_item *items;
+    int dir_fd;
+    char *dir;                  // absolute, for the journal
+    int n_done;
+};
+
+static bool bulk_rename_step(struct bulk_rename *br, const char *from, const char *to) {
+    char from_path[PATH_MAX], to_path[PATH_MAX];
+
+    // every target was free when the plan was made; it must still be
+    if (!rename_no_replace(br->dir_fd, from, to)) {
+        return false;
+    }
+    snprintf(from_path, PATH_MAX, "%s/%s", br->dir, from);
+    snprintf(to_path, PATH_MAX, "%s/%s", br->dir, to);
+    journal_append("rename", from_path, to_path);
+    return true;
+}
+
+static bool bulk_rename_item(struct bulk_rename *br, int i) {
+    struct rename_item *item = &br->items[i];
+    if (!bulk_rename_step(br, br->block->files[item->index].name, item->new_name)) {
+        return false;
+    }
+    item->done = true;
+    br->n_done++;
+    return true;
+}
+
+// A cycle c0 -> c1 -> ... -> c0 takes k-1 exchanges: each one swaps the
+// content under c0's name into place. Without exchanges, c0 steps aside
+// to a temporary name and the rest becomes a chain.
+static bool bulk_rename_cycle(struct bulk_rename *br, int start, int *prev) {
+    struct rename_item *items = br->items;
+    const char *first = br->block->files[items[start].index].name;
+    char from_path[PATH_MAX], to_path[PATH_MAX];
+
+    for (int k = items[start].next; k != start; k = items[k].next) {
+        const char *other = br->block->files[items[k].index].name;
+        if (!exchange_names(br->dir_fd, first, other)) {
+            if (k == items[start].next) {
+                break; // nothing moved yet, fall back to a temporary name
+            }
+            return false;
+        }
+        snprintf(from_path, PATH_MAX, "%s/%s", br->dir, first);
+        snprintf(to_path, PATH_MAX, "%s/%s", br->dir, other);
+        journal_append("exchange", from_path, to_path);
+        items[prev[k]].done = true;
+        br->n_done++;
+        if (items[k].next == start) {
+            items[k].done = true;
+            br->n_done++;
+            return true;
+        }
+    }
+
+    char temp[64];
+    struct stat st;
+    int n = 0;
+    do {
+        snprintf(temp, sizeof(temp), ".mordred-rename-%d-%d", (int) getpid(), n++);
+    } while (fstatat(br->dir_fd, temp, &st, AT_SYMLINK_NOFOLLOW) == 0);
+
+    if (!bulk_rename_step(br, first, temp)) {
+        return false;
+    }
+    for (int j = prev[start]; j != start; j = prev[j]) {
+        if (!bulk_rename_item(br, j)) {
+            return false;
+        }
+    }
+    if (!bulk_rename_step(br, temp, items[start].new_name)) {
+        return false;
+    }
+    items[start].done = true;
+    br->n_done++;
+    return true;
+}
+
+// Runs a conflict free plan in one pass: chains from the end whose name
+// is free back to their start, then the cycles that are left.
+bool run_bulk_rename(struct dirblock *block, struct rename_item *items, int n_items, int *n_done) {
+    struct bulk_rename br = {block, items, open(block->path, O_RDONLY | O_DIRECTORY), realpath(block->path, NULL), 0};
+    int *prev = malloc(sizeof(int) * (n_items > 0 ? n_items : 1));
+    bool ok = br.dir_fd >= 0 && br.dir != NULL;
+
+    for (int i = 0; i < n_items; i++) {
+        prev[i] = -1;
+    }
+    for (int i = 0; i < n_items; i++) {
+        if (items[i].new_name && items[i].next >= 0) {
+            prev[items[i].next] = i;
+        }
+    }
+    for (int i = 0; i < n_items && ok; i++) {
+        if (items[i].new_name && items[i].next < 0) {
+            for (int j = i; j >= 0 && ok; j = prev[j]) {
+                ok = bulk_rename_item(&br, j);
+            }
+        }
+    }
+    for (int i = 0; i < n_items && ok; i++) {
+        if (items[i].new_name && !items[i].done) {
+            ok = bulk_rename_cycle(&br, i, prev);
+        }
+    }
+
+    int saved = errno;
+    if (br.dir_fd >= 0) {
+        close(br.dir_fd);
+    }
+    free(br.dir);
+    free(prev);
+    *n_done = br.n_done;
+    errno = saved;
+    return ok;
+}
+
+// applies the renames that happened to the listing, keeping the selection
+// on the same entry
+void update_renamed_entries(struct dirblock *block, struct rename_item *items, int n_items) {
+    for (int i = 0; i < n_items; i++) {
+        if (!items[i].done) {
+            continue;
+        }
+        struct entry *e = &block->files[items[i].index];
+        int file_class = e->file_class;
+        free_entry(e);
+        *e = make_entry(items[i].new_name);
+        e->file_class = file_class; // same inode, same content
+        items[i].new_name = NULL;
+    }
+    for (int i = 0; i < block->n_files; i++) {
+        block->files[i].marked = false;
+    }
+
+    char *selected = block->n_files > 0 ? block->files[block->selected_index].name : NULL;
+    sort_files(block->files, block->n_files);
+    for (int i = 0; i < block->n_files; i++) {
+        if (block->files[i].name == selected) {
+            block->selected_index = i;
+        }
+    }
+    block->selected = selected;
+    block->column_size = get_column_size(block->files, block->n_files);
+    block->mtime = get_dir_mtime(block->path);
+}
+
+// old -> new for every entry the pattern changes, conflicts in red
+void print_rename_preview(struct dirblock *block, struct rename_item *items, int n_items) {
+    int column = (wd.block_quantity >= 2) ? get_column_by_index(1) : get_column_by_index(0);
+    int width = wd.term_width - column - 2;
+    int first_row = wd.box_row + 1;
+    int rows = (wd.bottom_bar_row - 1) - first_row;
+    int row = 0;
+    int left = 0;
+
+    for (int r = 0; r < rows; r++) {
+        mvprintw(first_row + r, column, "%*s", width, "");
+    }
+    for (int i = 0; i < n_items; i++) {
+        if (items[i].new_name == NULL) {
+            continue;
+        }
+        if (row == rows - 1 && rows > 0) {
+            left++;
+            continue;
+        }
+        int pair = items[i].conflict ? 3 : 2;
+        attron(COLOR_PAIR(pair));
+        move(first_row + row++, column);
+        printw("%.*s -> %.*s", width / 2, block->files[items[i].index].name, width / 2, items[i].new_name);
+        attroff(COLOR_PAIR(pair));
+    }
+    if (left > 0) {
+        mvprintw(first_row + row, column, "... %d more", left);
+    }
+}
+
+void bulk_rename_bar() {
+    struct dirblock *block = wd.current_block;
+    struct rename_item *items = malloc(sizeof(struct rename_item) * (block->n_files > 0 ? block->n_files : 1));
+    int n_items = 0;
+    char input[RENAME_INPUT_MAX] = "";
+    char message[64];
+    char status[128];
+    int len = 0;
+    bool ready = false;
+
+    for (int i = 0; i < block->n_files; i++) {
+        if (block->files[i].marked) {
+            items[n_items++] = (struct rename_item){i, NULL, -1, false, false};
+        }
+    }
+    if (n_items == 0) {
+        for (int i = 0; i < block->n_files; i++) {
+            items[n_items++] = (struct rename_item){i, NULL, -1, false, false};
+        }
+    }
+    if (n_items == 0) {
+        free(items);
+        return;
+    }
+    snprintf(message, sizeof(message), "Rename %d: ", n_items);
+
+    while (1) {
+        struct rename_pattern p;
+        int n_changes = 0;
+
+        status[0] = '\0';
+        ready = false;
+        if (len > 0 && parse_rename_pattern(input, &p, status, sizeof(status))) {
+            int n_conflicts = plan_bulk_rename(block, items, n_items, &p, &n_changes);
+            free_rename_pattern(&p);
+            snprintf(status, sizeof(status), "%d to rename, %d conflicts", n_changes, n_conflicts);
+            ready = n_changes > 0 && n_conflicts == 0;
+        } else {
+            for (int i = 0; i < n_items; i++) {
+                free(items[i].new_name);
+                items[i].new_name = NULL;
+            }
+        }
+
+        print_rename_preview(block, items, n_items);
+        move(wd.bottom_bar_row, 0);
+        clrtoeol();
+        attron(COLOR_PAIR(ready ? 2 : 3));
+        mvprintw(wd.bottom_bar_row, wd.term_width - strlen(status) - 1, "%s", status);
+        attroff(COLOR_PAIR(ready ? 2 : 3));
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, input);
+        attroff(COLOR_PAIR(2));
+
+        int ch = read_key();
+        if (ch == KEY_BACKSPACE || ch == K_BACKSPACE) {
+            if (len > 0) {
+                input[--len] = '\0';
+            }
+        } else if (ch == KEY_ENTER || ch == K_ENTER) {
+            if (ready) {
+                break;
+            }
+        } else if (ch == 27) {
+            ready = false;
+            break;
+        } else if (ch >= 0x20 && ch < 0x100 && len < RENAME_INPUT_MAX - 1) {
+            input[len++] = ch;
+            input[len] = '\0';
+        }
+    }
+
+    if (ready) {
+        int n_done;
+        int n_changes = 0;
+        for (int i = 0; i < n_items; i++) {
+            n_changes += items[i].new_name != NULL;
+        }
+        bool ok = run_bulk_rename(block, items, n_items, &n_done);
+        if (ok) {
+            snprintf(status, sizeof(status), "Renamed %d files", n_done);
+        } else if (errno == EEXIST) {
+            snprintf(status, sizeof(status), "Renamed %d of %d files: a file appeared under a new name, stopped", n_done, n_changes);
+        } else {
+            snprintf(status, sizeof(status), "Renamed %d of %d files: %s", n_done, n_changes, strerror(errno));
+        }
+        update_renamed_entries(block, items, n_items);
+        show_message_bottom_bar(status);
+    }
+
+    for (int i = 0; i < n_items; i++) {
+        free(items[i].new_name);
+    }
+    free(items);
+}
+
+// XXH64, streaming version
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state
+{
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+};
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_init(struct xxh64_state *s, uint64_t seed) {
+    memset(s, 0, sizeof(*s));
+    s->seed = seed;
+    s->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    s->v[1] = seed + XXH_PRIME64_2;
+    s->v[2] = seed;
+    s->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64_update(struct xxh64_state *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->total += len;
+
+    if (s->buffered + len < 32) {
+        memcpy(s->buffer + s->buffered, p, len);
+        s->buffered += len;
+        return;
+    }
+    if (s->buffered) {
+        size_t fill = 32 - s->buffered;
+        memcpy(s->buffer + s->buffered, p, fill);
+        for (int i = 0; i < 4; i++) {
+            s->v[i] = xxh64_round(s->v[i], read_le64(s->buffer + i * 8));
+        }
+        p += fill;
+        len -= fill;
+        s->buffered = 0;
+    }
+    while (len >= 32) {
+        for (int i = 0; i < 4; i++) {
+            s->v[i] = xxh64_round(s->v[i], read_le64(p + i * 8));
+        }
+        p += 32;
+        len -= 32;
+    }
+    memcpy(s->buffer, p, len);
+    s->buffered = len;
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh64_merge(h, s->v[i]);
+        }
+    } else {
+        h = s->seed + XXH_PRIME64_5;
+    }
+    h += s->total;
+
+    const unsigned char *p = s->buffer;
+    size_t len = s->buffered;
+    while (len >= 8) {
+        h ^= xxh64_round(0, read_le64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t) read_le32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= (*p++) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#define HASH_EDGE_SIZE   (64 * 1024)
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
+// hash of the first and last HASH_EDGE_SIZE bytes, which is the whole
+// content for files up to twice that size
+bool hash_file_edges(const char *path, off_t size, uint64_t *hash) {
+    unsigned char *buffer = malloc(HASH_EDGE_SIZE);
+    struct xxh64_state s;
+    bool ok = true;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(buffer);
+        return false;
+    }
+
+    xxh64_init(&s, 0);
+    off_t head = size < HASH_EDGE_SIZE ? size : HASH_EDGE_SIZE;
+    off_t tail_start = size - HASH_EDGE_SIZE > head ? size - HASH_EDGE_SIZE : head;
+    if (pread(fd, buffer, head, 0) != head) {
+        ok = false;
+    } else {
+        xxh64_update(&s, buffer, head);
+    }
+    if (ok && tail_start < size) {
+        if (pread(fd, buffer, size - tail_start, tail_start) != size - tail_start) {
+            ok = false;
+        } else {
+            xxh64_update(&s, buffer, size - tail_start);
+        }
+    }
+
+    close(fd);
+    free(buffer);
+    *hash = xxh64_digest(&s);
+    return ok;
+}
+
+bool hash_file(const char *path, uint64_t *hash) {
+    unsigned char *buffer = malloc(HASH_BUFFER_SIZE);
+    struct xxh64_state s;
+    ssize_t got;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(buffer);
+        return false;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    xxh64_init(&s, 0);
+    while ((got = read(fd, buffer, HASH_BUFFER_SIZE)) > 0) {
+        xxh64_update(&s, buffer, got);
+    }
+
+    close(fd);
+    free(buffer);
+    *hash = xxh64_digest(&s);
+    return got == 0;
+}
+
+// Duplicate finder: files are bucketed by size, then by a hash of their
+// edges, and only what still collides gets a full content hash.
+
+struct dup_candidate
+{
+    struct walk_file *file;
+    uint64_t edge_hash;
+    uint64_t hash;
+    bool ok;
+};
+
+struct dup_job
+{
+    const char *root;
+    struct dup_candidate *candidates;
+    int n_candidates;
+    bool full;              // full hash instead of the edges
+    int next;
+    int done;
+    volatile bool cancel;
+};
+
+static void *dup_hash_worker(void *arg) {
+    struct dup_job *job = arg;
+    int i;
+
+    while (!job->cancel && (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_candidates) {
+        struct dup_candidate *c = &job->candidates[i];
+        char *path = get_new_path((char *) job->root, c->file->path);
+        if (job->full) {
+            c->ok = hash_file(path, &c->hash);
+        } else {
+            c->ok = hash_file_edges(path, c->file->size, &c->edge_hash);
+            c->hash = c->edge_hash;
+        }
+        free(path);
+        __atomic_fetch_add(&job->done, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int compare_walk_size(const void *a, const void *b) {
+    const struct walk_file *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const struct dup_candidate *x = a, *y = b;
+    if (x->file->size != y->file->size) {
+        return x->file->size > y->file->size ? -1 : 1;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return strcmp(x->file->path, y->file->path);
+}
+
+// True when the user pressed q or escape. Other keys typed meanwhile are
+// pushed back in order for the main loop. A replay only cancels where the
+// recording did, so any other scripted key is left for the main loop.
+bool poll_cancel_key(void) {
+    if (bn.replaying) {
+        int next = bn.next_key < bn.n_keys ? bn.keys[bn.next_key] : ERR;
+        if (next != 'q' && next != 27) {
+            return false;
+        }
+        return read_key() != ERR;
+    }
+
+    int typed[64];
+    int n_typed = 0;
+    bool cancel = false;
+    int ch;
+    timeout(0);
+    while (n_typed < 64 && (ch = read_key()) != ERR) {
+        if (ch == 'q' || ch == 27) {
+            cancel = true;
+        } else {
+            typed[n_typed++] = ch;
+        }
+    }
+    timeout(-1);
+    // ungetch is a stack, so the last key goes back first
+    while (n_typed > 0) {
+        ungetch(typed[--n_typed]);
+        bn.unread++;
+    }
+    return cancel;
+}
+
+// Runs worker on a pool of threads sharing job, reporting *done out of
+// total until they finish. q or escape sets *cancel; returns false then.
+bool run_with_progress(void *(*worker)(void *), void *job, int *done, int total,
+                       volatile bool *cancel, const char *stage) {
+    int n_threads = get_worker_count();
+    pthread_t threads[n_threads];
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, worker, job);
+    }
+
+    struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+    while (__atomic_load_n(done, __ATOMIC_RELAXED) < total && !*cancel) {
+        move(wd.bottom_bar_row, 0);
+        clrtoeol();
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "%s: %d/%d files (q to cancel)", stage,
+                 __atomic_load_n(done, __ATOMIC_RELAXED), total);
+        attroff(COLOR_PAIR(2));
+        refresh();
+        poll(&input, 1, 100);
+        if (poll_cancel_key()) {
+            *cancel = true;
+        }
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return !*cancel;
+}
+
+bool run_dup_job(struct dup_job *job, const char *stage) {
+    job->next = 0;
+    job->done = 0;
+    job->cancel = false;
+    return run_with_progress(dup_hash_worker, job, &job->done, job->n_candidates, &job->cancel, stage);
+}
+
+// keeps the candidates sharing size and hash with a neighbour, grouped together
+int keep_colliding(struct dup_candidate *c, int n) {
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (c[i].ok) {
+            c[kept++] = c[i];
+        }
+    }
+    n = kept;
+    kept = 0;
+
+    qsort(c, n, sizeof(struct dup_candidate), compare_candidates);
+    for (int i = 0; i < n;) {
+        int j = i + 1;
+        while (j < n && c[j].file->size == c[i].file->size && c[j].hash == c[i].hash) {
+            j++;
+        }
+        for (int k = i; j - i > 1 && k < j; k++) {
+            c[kept++] = c[k];
+        }
+        i = j;
+    }
+    return kept;
+}
+
+struct dirblock get_duplicates_dirblock(char *root, struct dup_candidate *c, int n, int column) {
+    struct entry *files = malloc(sizeof(struct entry) * (n > 0 ? n : 1));
+    int group = -1;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || c[i].hash != c[i - 1].hash || c[i].file->size != c[i - 1].file->size) {
+            group++;
+        }
+        files[i] = make_entry(strdup(c[i].file->path));
+        files[i].group = group;
+    }
+
+    struct dirblock block = {strdup(root), n > 0 ? files[0].name : NULL, files, column, n, 0,
+                             get_column_size(files, n), 0, 0, NULL, 0};
+    block.duplicates = true;
+    return block;
+}
+
+// scans the current block's directory and pushes the duplicate sets as a block
+void find_duplicates(void) {
+    struct walker w;
+    char *root = wd.current_block->path;
+
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Scanning %s...", root);
+    attroff(COLOR_PAIR(2));
+    clrtoeol();
+    refresh();
+    parallel_walk(&w, root, false);
+
+    // same size and not a hard link of the previous file
+    qsort(w.files, w.n_files, sizeof(struct walk_file), compare_walk_size);
+    struct dup_candidate *c = malloc(sizeof(struct dup_candidate) * (w.n_files > 0 ? w.n_files : 1));
+    int n = 0;
+    for (int i = 0; i < w.n_files;) {
+        int j = i + 1;
+        while (j < w.n_files && w.files[j].size == w.files[i].size) {
+            j++;
+        }
+        if (j - i > 1 && w.files[i].size > 0) {
+            for (int k = i; k < j; k++) {
+                if (k > i && w.files[k].dev == w.files[k - 1].dev && w.files[k].ino == w.files[k - 1].ino) {
+                    continue;
+                }
+                c[n++] = (struct dup_candidate){&w.files[k], 0, 0, false};
+            }
+        }
+        i = j;
+    }
+
+    struct dup_job job = {root, c, n, false};
+    bool finished = run_dup_job(&job, "Hashing file edges");
+    n = keep_colliding(c, n);
+
+    // the edge hash already covered the whole content of small files
+    int n_big = 0;
+    for (int i = 0; i < n; i++) {
+        if (c[i].file->size > 2 * HASH_EDGE_SIZE) {
+            struct dup_candidate tmp = c[n_big];
+            c[n_big++] = c[i];
+            c[i] = tmp;
+        }
+    }
+    if (finished && n_big > 0) {
+        job = (struct dup_job){root, c, n_big, true};
+        finished = run_dup_job(&job, "Hashing contents");
+        n = keep_colliding(c, n);
+    }
+
+    if (!finished) {
+        show_message_bottom_bar("Duplicate scan cancelled");
+    } else if (n == 0) {
+        show_message_bottom_bar("No duplicate files found");
+    } else {
+        int next_column = get_next_column(wd.blocks, wd.block_quantity);
+        wd.blocks = realloc(wd.blocks, sizeof(struct dirblock) * (wd.block_quantity + 1));
+        wd.blocks[wd.block_quantity] = get_duplicates_dirblock(root, c, n, next_column);
+        wd.current_block = &wd.blocks[wd.block_quantity];
+        wd.block_quantity++;
+    }
+
+    free(c);
+    free_walk_files(w.files, w.n_files);
+}
+
+// Directory compare. Both trees are walked in parallel and matched by
+// relative path. Equal size and mtime count as the same file; with
+// hashing on, equal sizes with different mtimes are settled by content.
+// The sync copies what differs from the source into the target.
+
+enum diff_status
+{
+    DIFF_SAME,
+    DIFF_ADDED,             // only in the source
+    DIFF_REMOVED,           // only in the target
+    DIFF_CHANGED,
+};
+
+char DIFF_MARKS[] = {'=', '+', '-', '~'};
+int DIFF_COLORS[] = {0, 2, 3, 4};
+
+struct compare_item
+{
+    char *path;             // relative to both roots
+    int diff;
+};
+
+struct comparison
+{
+    char *source;
+    char *target;
+    bool hash_ties;
+    struct compare_item *items;
+    int n_items;
+    int counts[4];
+};
+
+struct comparison cmp;
+
+static int compare_walk_path(const void *a, const void *b) {
+    return strcmp(((const struct walk_file *) a)->path, ((const struct walk_file *) b)->path);
+}
+
+void free_comparison(struct comparison *c) {
+    for (int i = 0; i < c->n_items; i++) {
+        free(c->items[i].path);
+    }
+    free(c->items);
+    free(c->source);
+    free(c->target);
+    memset(c, 0, sizeof(*c));
+}
+
+// fills out with the differences between source and target, false when
+// the hashing was cancelled
+bool compare_directories(const char *source, const char *target, bool hash_ties, struct comparison *out) {
+    struct walker ws, wt;
+
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Scanning %s and %s...", source, target);
+    attroff(COLOR_PAIR(2));
+    clrtoeol();
+    refresh();
+    parallel_walk(&ws, source, false);
+    parallel_walk(&wt, target, false);
+    qsort(ws.files, ws.n_files, sizeof(struct walk_file), compare_walk_path);
+    qsort(wt.files, wt.n_files, sizeof(struct walk_file), compare_walk_path);
+
+    int max = ws.n_files + wt.n_files;
+    struct compare_item *items = malloc(sizeof(struct compare_item) * (max > 0 ? max : 1));
+    struct dup_candidate *source_ties = malloc(sizeof(struct dup_candidate) * (max > 0 ? max : 1));
+    struct dup_candidate *target_ties = malloc(sizeof(struct dup_candidate) * (max > 0 ? max : 1));
+    int *tie_items = malloc(sizeof(int) * (max > 0 ? max : 1));
+    int n_items = 0, n_ties = 0;
+    int i = 0, j = 0;
+
+    while (i < ws.n_files || j < wt.n_files) {
+        int order = i == ws.n_files ? 1 : (j == wt.n_files ? -1 : strcmp(ws.files[i].path, wt.files[j].path));
+        if (order < 0) {
+            items[n_items++] = (struct compare_item){strdup(ws.files[i++].path), DIFF_ADDED};
+        } else if (order > 0) {
+            items[n_items++] = (struct compare_item){strdup(wt.files[j++].path), DIFF_REMOVED};
+        } else {
+            struct walk_file *s = &ws.files[i++], *t = &wt.files[j++];
+            int diff = DIFF_SAME;
+            if (s->size != t->size) {
+                diff = DIFF_CHANGED;
+            } else if (s->mtime != t->mtime) {
+                diff = DIFF_CHANGED;
+                if (hash_ties) {
+                    source_ties[n_ties] = (struct dup_candidate){s, 0, 0, false};
+                    target_ties[n_ties] = (struct dup_candidate){t, 0, 0, false};
+                    tie_items[n_ties++] = n_items;
+                }
+            }
+            items[n_items++] = (struct compare_item){strdup(s->path), diff};
+        }
+    }
+
+    bool finished = true;
+    if (n_ties > 0) {
+        struct dup_job job = {source, source_ties, n_ties, true};
+        finished = run_dup_job(&job, "Hashing source files");
+        if (finished) {
+            job = (struct dup_job){target, target_ties, n_ties, true};
+            finished = run_dup_job(&job, "Hashing target files");
+        }
+        for (int k = 0; finished && k < n_ties; k++) {
+            if (source_ties[k].ok && target_ties[k].ok && source_ties[k].hash == target_ties[k].hash) {
+                items[tie_items[k]].diff = DIFF_SAME;
+            }
+        }
+    }
+
+    free(source_ties);
+    free(target_ties);
+    free(tie_items);
+    free_walk_files(ws.files, ws.n_files);
+    free_walk_files(wt.files, wt.n_files);
+
+    memset(out, 0, sizeof(*out));
+    out->source = strdup(source);
+    out->target = strdup(target);
+    out->hash_ties = hash_ties;
+    out->items = items;
+    out->n_items = n_items;
+    for (int k = 0; k < n_items; k++) {
+        out->counts[items[k].diff]++;
+    }
+    if (!finished) {
+        free_comparison(out);
+    }
+    return finished;
+}
+
+// one side of the comparison: the source leaves out what only the target has
+struct dirblock get_comparison_dirblock(struct comparison *c, bool source_side, int column) {
+    struct entry *files = malloc(sizeof(struct entry) * (c->n_items > 0 ? c->n_items : 1));
+    int n = 0;
+
+    for (int i = 0; i < c->n_items; i++) {
+        if (c->items[i].diff == (source_side ? DIFF_REMOVED : DIFF_ADDED)) {
+            continue;
+        }
+        files[n] = make_entry(strdup(c->items[i].path));
+        files[n].diff = c->items[i].diff;
+        n++;
+    }
+
+    struct dirblock block = {strdup(source_side ? c->source : c->target), n > 0 ? files[0].name : NULL, files, column, n, 0,
+                             get_column_size(files, n), 0, 0, NULL, 0};
+    block.comparison = true;
+    return block;
+}
+
+// Shows cmp as two blocks side by side, the source on the left, in place
+// of the panes of an earlier comparison, keeping their selections.
+void show_comparison(void) {
+    char *selected[2] = {NULL, NULL};
+    int q = wd.block_quantity;
+    int side = 0;
+
+    while (q > 1 && wd.blocks[q - 1].comparison) {
+        q--;
+    }
+    for (int i = q; i < wd.block_quantity && side < 2; i++, side++) {
+        selected[side] = wd.blocks[i].selected ? strdup(wd.blocks[i].selected) : NULL;
+    }
+    for (int i = q; i < wd.block_quantity; i++) {
+        free_block(i);
+    }
+
+    wd.blocks = realloc(wd.blocks, sizeof(struct dirblock) * (q + 2));
+    for (side = 0; side < 2; side++) {
+        struct dirblock *block = &wd.blocks[q + side];
+        *block = get_comparison_dirblock(&cmp, side == 0, get_next_column(wd.blocks, q + side));
+        for (int k = 0; k < block->n_files; k++) {
+            if (equal_strings(block->files[k].name, selected[side])) {
+                block->selected_index = k;
+                block->selected = block->files[k].name;
+            }
+        }
+        free(selected[side]);
+    }
+    wd.block_quantity = q + 2;
+    wd.current_block = &wd.blocks[q + 1];
+}
+
+void compare_bar(const char *source, const char *target, bool hash_ties) {
+    char message[128];
+
+    free_comparison(&cmp);
+    if (!compare_directories(source, target, hash_ties, &cmp)) {
+        show_message_bottom_bar("Compare cancelled");
+        return;
+    }
+    if (cmp.n_items == 0) {
+        show_message_bottom_bar("Both directories are empty");
+        return;
+    }
+    show_comparison();
+    snprintf(message, sizeof(message), "%d added, %d removed, %d changed, %d same (S to sync)",
+             cmp.counts[DIFF_ADDED], cmp.counts[DIFF_REMOVED], cmp.counts[DIFF_CHANGED], cmp.counts[DIFF_SAME]);
+    show_message_bottom_bar(message);
+}
+
+// Copies the data with the fastest path the system offers: copy_file_range
+// keeps it in the kernel and lets filesystems that can share extents do
+// so, fcopyfile does the same on macOS, read/write is the fallback.
+static bool copy_fd(int in, int out, off_t size) {
+#if defined(__linux__)
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n == 0) {
+            return true; // the file shrank under us
+        }
+        if (n < 0) {
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                return false;
+            }
+            break; // carry on from the same offsets the slow way
+        }
+        left -= n;
+    }
+    if (left == 0) {
+        return true;
+    }
+#elif defined(__APPLE__)
+    return fcopyfile(in, out, NULL, COPYFILE_DATA) == 0;
+#endif
+    size_t buffer_size = 1024 * 1024;
+    char *buffer = malloc(buffer_size);
+    ssize_t n;
+    bool ok = true;
+    while (ok && (n = read(in, buffer, buffer_size)) > 0) {
+        for (ssize_t written = 0; ok && written < n; ) {
+            ssize_t w = write(out, buffer + written, n - written);
+            ok = w > 0;
+            written += w;
+        }
+    }
+    free(buffer);
+    return ok && n == 0;
+}
+
+// Copies src over dest through a temporary file renamed into place, so
+// dest is never half written, keeping the mode and mtime of src.
+bool sync_file(const char *src, const char *dest) {
+    struct stat st;
+    char temp[PATH_MAX];
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) {
+            close(in);
+        }
+        return false;
+    }
+    char *dir = get_parent_path(dest);
+    snprintf(temp, PATH_MAX, "%s/.mordred-sync-XXXXXX", dir);
+    free(dir);
+    int out = mkstemp(temp);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = copy_fd(in, out, st.st_size);
+    int64_t mtime = get_mtime_ns(&st);
+    struct timespec times[2] = {{0, UTIME_OMIT}, {mtime / 1000000000, mtime % 1000000000}};
+    ok = ok && fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0;
+    ok = close(out) == 0 && ok;
+    close(in);
+    if (ok && rename(temp, dest) == 0) {
+        return true;
+    }
+    unlink(temp);
+    return false;
+}
+
+struct sync_job
+{
+    const char *source;
+    const char *target;
+    struct compare_item **items;
+    int n_items;
+    int next;
+    int done;
+    int failed;
+    volatile bool cancel;
+};
+
+static void *sync_worker(void *arg) {
+    struct sync_job *job = arg;
+    int i;
+
+    while (!job->cancel && (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_items) {
+        char *src = get_new_path((char *) job->source, job->items[i]->path);
+        char *dest = get_new_path((char *) job->target, job->items[i]->path);
+        make_parent_dirs(dest, 0777);
+        if (!sync_file(src, dest)) {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+        free(src);
+        free(dest);
+        __atomic_fetch_add(&job->done, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// copies what was added or changed in the source over to the target;
+// files only in the target are left alone
+void sync_bar(void) {
+    struct compare_item **items = malloc(sizeof(struct compare_item *) * (cmp.n_items > 0 ? cmp.n_items : 1));
+    char message[PATH_MAX];
+    int n = 0;
+
+    for (int i = 0; i < cmp.n_items; i++) {
+        if (cmp.items[i].diff == DIFF_ADDED || cmp.items[i].diff == DIFF_CHANGED) {
+            items[n++] = &cmp.items[i];
+        }
+    }
+    if (n == 0) {
+        free(items);
+        show_message_bottom_bar("Nothing to sync");
+        return;
+    }
+
+    move(wd.bottom_bar_row, 0);
+    clrtoeol();
+    attron(COLOR_PAIR(2));
+    mvprintw(wd.bottom_bar_row, 0, "Copy %d files from %s to %s? [y/n]", n, cmp.source, cmp.target);
+    attroff(COLOR_PAIR(2));
+    int ch = read_key();
+    if (ch != 'y' && ch != 'Y') {
+        free(items);
+        return;
+    }
+
+    struct sync_job job = {cmp.source, cmp.target, items, n, 0, 0, 0, false};
+    bool finished = run_with_progress(sync_worker, &job, &job.done, n, &job.cancel, "Syncing");
+    snprintf(message, sizeof(message), "%s %d of %d files, %d failed", finished ? "Synced" : "Cancelled after",
+             job.done - job.failed, n, job.failed);
+    free(items);
+
+    char *source = strdup(cmp.source);
+    char *target = strdup(cmp.target);
+    bool hash_ties = cmp.hash_ties;
+    free_comparison(&cmp);
+    if (compare_directories(source, target, hash_ties, &cmp)) {
+        show_comparison();
+    }
+    free(source);
+    free(target);
+    show_message_bottom_bar(message);
+}
+
+// Syntax highlighting for the preview pane. Each line is lexed on its own
+// given the state left by the previous one, so the lexer state is saved
+// every CHECKPOINT_LINES lines and any window of a file can be lexed by
+// starting from the checkpoint just above it.
+
+enum language
+{
+    LANG_NONE,
+    LANG_C,
+    LANG_PYTHON,
+    LANG_JAVA,
+    LANG_SHELL,
+    LANG_YAML,
+    LANG_JSON,
+    LANG_LOG
+};
+
+enum token
+{
+    TOK_PLAIN,
+    TOK_KEYWORD,
+    TOK_TYPE,
+    TOK_STRING,
+    TOK_NUMBER,
+    TOK_COMMENT,
+    TOK_PREPROC,
+    TOK_KEY,
+    TOK_ERROR,
+    TOK_WARN,
+    TOK_INFO,
+    TOK_DEBUG
+};
+
+enum lex_state
+{
+    LEX_NORMAL,
+    LEX_BLOCK_COMMENT,
+    LEX_TRIPLE_DOUBLE,
+    LEX_TRIPLE_SINGLE
+};
+
+// color pair used for every token, see start_ncurses(); strings and info
+// lines share green with the rest of the interface on purpose
+int TOKEN_COLORS[] = {0, 4, 7, 2, 6, 5, 6, 7, 3, 4, 2, 5};
+
+struct span
+{
+    int start;
+    int len;
+    unsigned char token;
+};
+
+struct language_def
+{
+    const char **keywords;
+    const char **types;
+    const char *line_comment;
+    bool block_comments;
+    bool triple_quotes;
+    bool preprocessor;
+    bool variables;
+};
+
+const char *C_KEYWORDS[] = {"if", "else", "for", "while", "do", "switch", "case", "default", "break",
+    "continue", "return", "goto", "sizeof", "typedef", "struct", "union", "enum", "static", "extern",
+    "const", "volatile", "inline", "register", "restrict", "class", "public", "private", "protected",
+    "virtual", "override", "template", "typename", "namespace", "using", "new", "delete", "this",
+    "try", "catch", "throw", "nullptr", "true", "false", "constexpr", "noexcept", "operator",
+    "friend", "NULL", NULL};
+const char *C_TYPES[] = {"int", "char", "void", "short", "long", "float", "double", "signed",
+    "unsigned", "bool", "auto", "size_t", "ssize_t", "off_t", "int8_t", "int16_t", "int32_t",
+    "int64_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t", "wchar_t", "FILE", NULL};
+const char *JAVA_KEYWORDS[] = {"class", "interface", "extends", "implements", "public", "private",
+    "protected", "static", "final", "abstract", "new", "return", "if", "else", "for", "while", "do",
+    "switch", "case", "default", "break", "continue", "try", "catch", "finally", "throw", "throws",
+    "import", "package", "this", "super", "null", "true", "false", "instanceof", "synchronized",
+    "volatile", "transient", "native", "enum", "var", "record", NULL};
+const char *JAVA_TYPES[] = {"int", "long", "short", "byte", "char", "boolean", "float", "double",
+    "void", "String", "Object", NULL};
+const char *PYTHON_KEYWORDS[] = {"def", "class", "return", "if", "elif", "else", "for", "while",
+    "in", "not", "and", "or", "is", "None", "True", "False", "import", "from", "as", "with", "try",
+    "except", "finally", "raise", "lambda", "yield", "pass", "break", "continue", "global",
+    "nonlocal", "assert", "del", "async", "await", NULL};
+const char *PYTHON_TYPES[] = {"self", "cls", "int", "float", "str", "bytes", "list", "dict", "set",
+    "tuple", "bool", "object", "print", "len", "range", NULL};
+const char *SHELL_KEYWORDS[] = {"if", "then", "else", "elif", "fi", "for", "in", "do", "done",
+    "while", "until", "case", "esac", "function", "return", "export", "local", "readonly",
+    "declare", "unset", "shift", "exit", "break", "continue", "source", NULL};
+const char *SHELL_TYPES[] = {"echo", "cd", "test", "printf", "read", "eval", "exec", "trap", "set",
+    NULL};
+const char *DATA_KEYWORDS[] = {"true", "false", "null", "yes", "no", "on", "off", NULL};
+
+struct language_def LANGUAGES[] = {
+    [LANG_C] = {C_KEYWORDS, C_TYPES, "//", true, false, true, false},
+    [LANG_PYTHON] = {PYTHON_KEYWORDS, PYTHON_TYPES, "#", false, true, false, false},
+    [LANG_JAVA] = {JAVA_KEYWORDS, JAVA_TYPES, "//", true, false, false, false},
+    [LANG_SHELL] = {SHELL_KEYWORDS, SHELL_TYPES, "#", false, false, false, true},
+};
+
+struct text_extension
+{
+    char *extension;
+    int language;
+};
+
+struct text_extension TEXT_FILE_EXTENSIONS[] = {
+    {".txt", LANG_NONE}, {".md", LANG_NONE},
+    {".c", LANG_C}, {".h", LANG_C}, {".cc", LANG_C}, {".cpp", LANG_C}, {".cxx", LANG_C},
+    {".hpp", LANG_C}, {".hh", LANG_C},
+    {".py", LANG_PYTHON},
+    {".java", LANG_JAVA},
+    {".sh", LANG_SHELL}, {".bash", LANG_SHELL}, {".zsh", LANG_SHELL},
+    {".yml", LANG_YAML}, {".yaml", LANG_YAML},
+    {".json", LANG_JSON},
+    {".log", LANG_LOG},
+};
+
+int get_language(const char *path) {
+    const char *dot = strrchr(path, '.');
+    int n = sizeof(TEXT_FILE_EXTENSIONS) / sizeof(TEXT_FILE_EXTENSIONS[0]);
+
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return LANG_NONE;
+    }
+    for (int i = 0; i < n; i++) {
+        if (equal_strings(dot, TEXT_FILE_EXTENSIONS[i].extension)) {
+            return TEXT_FILE_EXTENSIONS[i].language;
+        }
+    }
+    return LANG_NONE;
+}
+
+static void add_span(struct span *spans, int *n, int max, int start, int len, int token) {
+    if (*n < max && len > 0) {
+        spans[(*n)++] = (struct span){start, len, token};
+    }
+}
+
+static bool is_word_char(char c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool in_word_list(const char **words, const char *s, int len) {
+    for (int i = 0; words && words[i]; i++) {
+        if ((int) strlen(words[i]) == len && strncmp(words[i], s, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// returns the index right after the first occurrence of needle, or -1
+static int find_after(const char *s, int from, int len, const char *needle) {
+    int nlen = strlen(needle);
+    for (int i = from; i + nlen <= len; i++) {
+        if (strncmp(s + i, needle, nlen) == 0) {
+            return i + nlen;
+        }
+    }
+    return -1;
+}
+
+// index right after the closing quote, honouring backslash escapes
+static int skip_quoted(const char *s, int i, int len, bool escapes) {
+    char quote = s[i++];
+    while (i < len && s[i] != quote) {
+        if (escapes && s[i] == '\\') {
+            i++;
+        }
+        i++;
+    }
+    return i < len ? i + 1 : len;
+}
+
+static int skip_number(const char *s, int i, int len) {
+    while (i < len && (is_word_char(s[i]) || s[i] == '.')) {
+        i++;
+    }
+    return i;
+}
+
+int lex_code(const struct language_def *def, const char *s, int len, int *state,
+             struct span *spans, int max) {
+    int n = 0;
+    int i = 0;
+    int comment_len = strlen(def->line_comment);
+
+    while (i < len) {
+        int start = i;
+
+        if (*state == LEX_BLOCK_COMMENT || *state == LEX_TRIPLE_DOUBLE || *state == LEX_TRIPLE_SINGLE) {
+            const char *end = *state == LEX_BLOCK_COMMENT ? "*/" : (*state == LEX_TRIPLE_DOUBLE ? "\"\"\"" : "'''");
+            int token = *state == LEX_BLOCK_COMMENT ? TOK_COMMENT : TOK_STRING;
+            int after = find_after(s, i, len, end);
+            if (after < 0) {
+                add_span(spans, &n, max, start, len - start, token);
+                return n;
+            }
+            add_span(spans, &n, max, start, after - start, token);
+            *state = LEX_NORMAL;
+            i = after;
+            continue;
+        }
+
+        char c = s[i];
+        if (strncmp(s + i, def->line_comment, comment_len) == 0 &&
+            (comment_len > 1 || i == 0 || s[i - 1] == ' ' || s[i - 1] == '\t')) {
+            add_span(spans, &n, max, start, len - start, TOK_COMMENT);
+            return n;
+        } else if (def->block_comments && strncmp(s + i, "/*", 2) == 0) {
+            *state = LEX_BLOCK_COMMENT;
+            i += 2;
+            int after = find_after(s, i, len, "*/");
+            i = after < 0 ? len : after;
+            if (after >= 0) {
+                *state = LEX_NORMAL;
+            }
+            add_span(spans, &n, max, start, i - start, TOK_COMMENT);
+        } else if (def->preprocessor && c == '#' && strspn(s, " \t") == (size_t) i) {
+            add_span(spans, &n, max, start, len - start, TOK_PREPROC);
+            return n;
+        } else if (def->triple_quotes && (strncmp(s + i, "\"\"\"", 3) == 0 || strncmp(s + i, "'''", 3) == 0)) {
+            *state = c == '"' ? LEX_TRIPLE_DOUBLE : LEX_TRIPLE_SINGLE;
+            i += 3;
+            int after = find_after(s, i, len, c == '"' ? "\"\"\"" : "'''");
+            i = after < 0 ? len : after;
+            if (after >= 0) {
+                *state = LEX_NORMAL;
+            }
+            add_span(spans, &n, max, start, i - start, TOK_STRING);
+        } else if (c == '"' || c == '\'') {
+            i = skip_quoted(s, i, len, !(def->variables && c == '\''));
+            add_span(spans, &n, max, start, i - start, TOK_STRING);
+        } else if (def->variables && c == '$') {
+            i++;
+            if (i < len && s[i] == '{') {
+                int after = find_after(s, i, len, "}");
+                i = after < 0 ? len : after;
+            } else {
+                while (i < len && is_word_char(s[i])) {
+                    i++;
+                }
+            }
+            add_span(spans, &n, max, start, i - start, TOK_TYPE);
+        } else if (is_digit(c) && (i == 0 || !is_word_char(s[i - 1]))) {
+            i = skip_number(s, i, len);
+            add_span(spans, &n, max, start, i - start, TOK_NUMBER);
+        } else if (is_word_char(c) || (c == '@' && def->triple_quotes)) {
+            i++;
+            while (i < len && is_word_char(s[i])) {
+                i++;
+            }
+            if (c == '@') {
+                add_span(spans, &n, max, start, i - start, TOK_TYPE);
+            } else if (in_word_list(def->keywords, s + start, i - start)) {
+                add_span(spans, &n, max, start, i - start, TOK_KEYWORD);
+            } else if (in_word_list(def->types, s + start, i - start)) {
+                add_span(spans, &n, max, start, i - start, TOK_TYPE);
+            }
+        } else {
+            i++;
+        }
+    }
+    return n;
+}
+
+// scalar values shared by YAML and JSON
+static int lex_value(const char *s, int i, int len, struct span *spans, int *n, int max) {
+    int start = i;
+    if (s[i] == '"' || s[i] == '\'') {
+        i = skip_quoted(s, i, len, s[i] == '"');
+        add_span(spans, n, max, start, i - start, TOK_STRING);
+    } else if (is_digit(s[i]) || (s[i] == '-' && i + 1 < len && is_digit(s[i + 1]))) {
+        i = skip_number(s, i + 1, len);
+        add_span(spans, n, max, start, i - start, TOK_NUMBER);
+    } else if (is_word_char(s[i])) {
+        while (i < len && is_word_char(s[i])) {
+            i++;
+        }
+        if (in_word_list(DATA_KEYWORDS, s + start, i - start)) {
+            add_span(spans, n, max, start, i - start, TOK_KEYWORD);
+        }
+    } else {
+        i++;
+    }
+    return i;
+}
+
+int lex_json(const char *s, int len, struct span *spans, int max) {
+    int n = 0;
+    int i = 0;
+    while (i < len) {
+        if (s[i] == '"') {
+            int start = i;
+            i = skip_quoted(s, i, len, true);
+            int j = i;
+            while (j < len && (s[j] == ' ' || s[j] == '\t')) {
+                j++;
+            }
+            add_span(spans, &n, max, start, i - start, j < len && s[j] == ':' ? TOK_KEY : TOK_STRING);
+        } else {
+            i = lex_value(s, i, len, spans, &n, max);
+        }
+    }
+    return n;
+}
+
+int lex_yaml(const char *s, int len, struct span *spans, int max) {
+    int n = 0;
+    int i = strspn(s, " \t");
+
+    if (strncmp(s, "---", 3) == 0 || strncmp(s, "...", 3) == 0) {
+        add_span(spans, &n, max, 0, 3, TOK_KEYWORD);
+        i = 3;
+    }
+    while (i + 1 < len && s[i] == '-' && s[i + 1] == ' ') {
+        i += 2;
+    }
+
+    // a key runs up to the first ": " outside quotes
+    int key_start = i;
+    for (int j = i; j < len && s[j] != '#' && s[j] != '"' && s[j] != '\''; j++) {
+        if (s[j] == ':' && (j + 1 == len || s[j + 1] == ' ')) {
+            add_span(spans, &n, max, key_start, j - key_start, TOK_KEY);
+            i = j + 1;
+            break;
+        }
+    }
+
+    while (i < len) {
+        int start = i;
+        if (s[i] == '#' && (i == 0 || s[i - 1] == ' ')) {
+            add_span(spans, &n, max, start, len - start, TOK_COMMENT);
+            break;
+        } else if (s[i] == '&' || s[i] == '*' || s[i] == '!') {
+            while (i < len && s[i] != ' ') {
+                i++;
+            }
+            add_span(spans, &n, max, start, i - start, TOK_TYPE);
+        } else {
+            i = lex_value(s, i, len, spans, &n, max);
+        }
+    }
+    return n;
+}
+
+struct severity
+{
+    const char *word;
+    int token;
+    bool whole_line;
+};
+
+struct severity SEVERITIES[] = {
+    {"FATAL", TOK_ERROR, true}, {"CRITICAL", TOK_ERROR, true}, {"CRIT", TOK_ERROR, true},
+    {"PANIC", TOK_ERROR, true}, {"ERROR", TOK_ERROR, true}, {"ERR", TOK_ERROR, true},
+    {"WARNING", TOK_WARN, true}, {"WARN", TOK_WARN, true},
+    {"INFO", TOK_INFO, false}, {"NOTICE", TOK_INFO, false},
+    {"DEBUG", TOK_DEBUG, true}, {"TRACE", TOK_DEBUG, true},
+};
+
+int lex_log(const char *s, int len, struct span *spans, int max) {
+    int n = 0;
+    int n_severities = sizeof(SEVERITIES) / sizeof(SEVERITIES[0]);
+
+    // leading timestamp
+    int i = 0;
+    if (len > 0 && is_digit(s[0])) {
+        while (i < len && (is_digit(s[i]) || strchr("-:.,T/ Z+", s[i]) != NULL)) {
+            i++;
+        }
+    }
+
+    for (int j = i; j < len; j++) {
+        if (j > 0 && is_word_char(s[j - 1])) {
+            continue;
+        }
+        for (int k = 0; k < n_severities; k++) {
+            int wlen = strlen(SEVERITIES[k].word);
+            if (j + wlen <= len && strncasecmp(s + j, SEVERITIES[k].word, wlen) == 0 &&
+                (j + wlen == len || !is_word_char(s[j + wlen]))) {
+                add_span(spans, &n, max, 0, i, TOK_NUMBER);
+                if (SEVERITIES[k].whole_line) {
+                    add_span(spans, &n, max, i, len - i, SEVERITIES[k].token);
+                } else {
+                    add_span(spans, &n, max, j, wlen, SEVERITIES[k].token);
+                }
+                return n;
+            }
+        }
+    }
+    add_span(spans, &n, max, 0, i, TOK_NUMBER);
+    return n;
+}
+
+// lexes one line, updating state for the next one
+int lex_line(int language, const char *s, int len, int *state, struct span *spans, int max) {
+    switch (language) {
+        case LANG_C:
+        case LANG_PYTHON:
+        case LANG_JAVA:
+        case LANG_SHELL:
+            return lex_code(&LANGUAGES[language], s, len, state, spans, max);
+        case LANG_YAML:
+            return lex_yaml(s, len, spans, max);
+        case LANG_JSON:
+            return lex_json(s, len, spans, max);
+        case LANG_LOG:
+            return lex_log(s, len, spans, max);
+    }
+    return 0;
+}
+
+#define CHECKPOINT_LINES   64
+#define PREVIEW_CACHE_SIZE 8
+#define PREVIEW_LINE_MAX   1024
+#define MAX_SPANS          128
+#define TAB_WIDTH          4
+
+struct checkpoint
+{
+    off_t offset;
+    int state;
+};
+
+struct preview_line
+{
+    char *text;
+    int len;
+    struct span *spans;
+    int n_spans;
+};
+
+// A file as shown in the preview pane: the lexed window currently on
+// screen plus the checkpoints collected while reading it.
+struct preview
+{
+    char *path;
+    char *file;                 // file holding the data, the archive for members
+    off_t base;                 // where the data starts in file
+    off_t length;               // -1 for the whole file
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    off_t size;
+    int language;
+    struct checkpoint *checkpoints;
+    int n_checkpoints;
+    bool reached_eof;
+    int total_lines;            // only known once reached_eof
+    int first_line;
+    struct preview_line *lines;
+    int n_lines;
+    int scroll;                 // first line shown
+    unsigned long last_used;
+};
+
+struct preview previews[PREVIEW_CACHE_SIZE];
+unsigned long preview_clock = 0;
+
+void free_preview_window(struct preview *pv) {
+    for (int i = 0; i < pv->n_lines; i++) {
+        free(pv->lines[i].text);
+        free(pv->lines[i].spans);
+    }
+    free(pv->lines);
+    pv->lines = NULL;
+    pv->n_lines = 0;
+}
+
+void free_preview(struct preview *pv) {
+    free_preview_window(pv);
+    free(pv->path);
+    free(pv->file);
+    free(pv->checkpoints);
+    memset(pv, 0, sizeof(*pv));
+}
+
+// Returns the cached preview shown as path, dropping it if the file
+// changed. Its data is length bytes of file starting at base, lexed as
+// language.
+struct preview *get_preview_of(const char *path, const char *file, off_t base, off_t length, int language) {
+    struct stat st;
+    struct preview *lru = &previews[0];
+
+    if (stat(file, &st) != 0) {
+        return NULL;
+    }
+
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; i++) {
+        struct preview *pv = &previews[i];
+        if (pv->path && equal_strings(pv->path, path)) {
+            if (pv->dev == st.st_dev && pv->ino == st.st_ino &&
+                pv->mtime == get_mtime_ns(&st) && pv->size == st.st_size) {
+                pv->last_used = ++preview_clock;
+                return pv;
+            }
+            lru = pv;
+            break;
+        }
+        if (pv->last_used < lru->last_used) {
+            lru = pv;
+        }
+    }
+
+    free_preview(lru);
+    lru->path = strdup(path);
+    lru->file = strdup(file);
+    lru->base = base;
+    lru->length = length;
+    lru->dev = st.st_dev;
+    lru->ino = st.st_ino;
+    lru->mtime = get_mtime_ns(&st);
+    lru->size = st.st_size;
+    lru->language = language;
+    lru->checkpoints = malloc(sizeof(struct checkpoint));
+    lru->checkpoints[0] = (struct checkpoint){0, LEX_NORMAL};
+    lru->n_checkpoints = 1;
+    lru->last_used = ++preview_clock;
+    return lru;
+}
+
+struct preview *get_preview(const char *path, int language) {
+    return get_preview_of(path, path, 0, -1, language);
+}
+
+// copies a line expanding tabs, keeping at most PREVIEW_LINE_MAX bytes
+char *expand_line(const char *line, ssize_t len, int *out_len) {
+    char *text = malloc(PREVIEW_LINE_MAX + 1);
+    int j = 0;
+    for (ssize_t i = 0; i < len && j < PREVIEW_LINE_MAX; i++) {
+        if (line[i] == '\n' || line[i] == '\r') {
+            continue;
+        }
+        if (line[i] == '\t') {
+            do {
+                text[j++] = ' ';
+            } while (j % TAB_WIDTH != 0 && j < PREVIEW_LINE_MAX);
+        } else {
+            text[j++] = line[i];
+        }
+    }
+    text[j] = '\0';
+    *out_len = j;
+    return text;
+}
+
+// Makes lines [first, first + count) available in pv->lines. Lexing starts
+// at the closest checkpoint, so only the window and the lines between the
+// checkpoint and the window are ever tokenized.
+void load_preview_window(struct preview *pv, int first, int count) {
+    if (pv->lines && pv->first_line == first && (pv->n_lines >= count || pv->reached_eof)) {
+        return;
+    }
+
+    FILE *fp = fopen(pv->file, "r");
+    if (!fp) {
+        return;
+    }
+    free_preview_window(pv);
+
+    int k = first / CHECKPOINT_LINES;
+    if (k >= pv->n_checkpoints) {
+        k = pv->n_checkpoints - 1;
+    }
+    int line_no = k * CHECKPOINT_LINES;
+    int state = pv->checkpoints[k].state;
+    fseeko(fp, pv->base + pv->checkpoints[k].offset, SEEK_SET);
+
+    pv->lines = malloc(sizeof(struct preview_line) * count);
+    pv->first_line = first;
+    struct span spans[MAX_SPANS];
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read;
+
+    while (pv->n_lines < count) {
+        off_t offset = ftello(fp) - pv->base;
+        if (line_no % CHECKPOINT_LINES == 0 && line_no / CHECKPOINT_LINES == pv->n_checkpoints) {
+            pv->checkpoints = realloc(pv->checkpoints, sizeof(struct checkpoint) * (pv->n_checkpoints + 1));
+            pv->checkpoints[pv->n_checkpoints++] = (struct checkpoint){offset, state};
+        }
+        if ((pv->length >= 0 && offset >= pv->length) || (read = getline(&line, &cap, fp)) == -1) {
+            pv->reached_eof = true;
+            pv->total_lines = line_no;
+            break;
+        }
+        if (pv->length >= 0 && offset + read > pv->length) {
+            read = pv->length - offset;
+        }
+
+        if (line_no < first) {
+            lex_line(pv->language, line, read, &state, spans, MAX_SPANS);
+        } else {
+            struct preview_line *pl = &pv->lines[pv->n_lines++];
+            pl->text = expand_line(line, read, &pl->len);
+            pl->n_spans = lex_line(pv->language, pl->text, pl->len, &state, spans, MAX_SPANS);
+            pl->spans = malloc(sizeof(struct span) * (pl->n_spans > 0 ? pl->n_spans : 1));
+            memcpy(pl->spans, spans, sizeof(struct span) * pl->n_spans);
+        }
+        line_no++;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+// writes at most *room bytes of s without cutting a UTF-8 sequence
+void add_clipped(const char *s, int len, int *room) {
+    if (len > *room) {
+        len = *room;
+        while (len > 0 && (s[len] & 0xC0) == 0x80) {
+            len--;
+        }
+    }
+    if (len > 0) {
+        addnstr(s, len);
+        *room -= len;
+    }
+}
+
+void print_preview_line(int row, int column, const struct preview_line *pl, int max_width) {
+    int room = max_width;
+    int pos = 0;
+
+    move(row, column);
+    for (int i = 0; i < pl->n_spans && room > 0; i++) {
+        const struct span *sp = &pl->spans[i];
+        if (sp->start < pos) {
+            continue;
+        }
+        add_clipped(pl->text + pos, sp->start - pos, &room);
+        attron(COLOR_PAIR(TOKEN_COLORS[sp->token]));
+        add_clipped(pl->text + sp->start, sp->len, &room);
+        attroff(COLOR_PAIR(TOKEN_COLORS[sp->token]));
+        pos = sp->start + sp->len;
+    }
+    add_clipped(pl->text + pos, pl->len - pos, &room);
+}
+
+// scrolls the preview on screen, which print_overview() already cached
+void scroll_preview(char *path, int lines) {
+    struct preview *pv = NULL;
+    for (int i = 0; path && i < PREVIEW_CACHE_SIZE; i++) {
+        if (previews[i].path && equal_strings(previews[i].path, path)) {
+            pv = &previews[i];
+        }
+    }
+    if (pv == NULL) {
+        return;
+    }
+    pv->scroll += lines;
+    if (pv->scroll < 0) {
+        pv->scroll = 0;
+    }
+    if (pv->reached_eof && pv->scroll >= pv->total_lines) {
+        pv->scroll = pv->total_lines > 0 ? pv->total_lines - 1 : 0;
+    }
+}
+
+bool is_regular(char *path) {
+    struct stat path_stat;
+
+    if (stat(path, &path_stat) != 0) {
+        // Error: file does not exist or cannot be accessed
+        return false;
+    }
+
+    return S_ISREG(path_stat.st_mode);
+}
+
+// File classification. The first CLASSIFY_SAMPLE bytes of a file are
+// matched against magic numbers and otherwise judged as text or binary by
+// their NUL and control bytes and their UTF-8 validity. Results are cached
+// by dev/inode/mtime, and on the entry itself once it has been drawn.
+
+#define CLASSIFY_SAMPLE  4096
+#define CLASS_CACHE_SIZE 4096
+
+enum file_class
+{
+    CLASS_UNKNOWN,          // not classified yet
+    CLASS_DIRECTORY,
+    CLASS_EMPTY,
+    CLASS_TEXT,
+    CLASS_EXECUTABLE,
+    CLASS_IMAGE,
+    CLASS_ARCHIVE,
+    CLASS_DOCUMENT,
+    CLASS_BINARY,
+    CLASS_OTHER,            // devices, sockets, broken links
+};
+
+// color pair of each class in the listings, 0 for the default
+int CLASS_COLORS[] = {
+    [CLASS_DIRECTORY] = 5,
+    [CLASS_EXECUTABLE] = 2,
+    [CLASS_IMAGE] = 6,
+    [CLASS_ARCHIVE] = 3,
+    [CLASS_DOCUMENT] = 4,
+    [CLASS_OTHER] = 7,
+};
+
+struct magic_number
+{
+    int offset;
+    int len;
+    const char *bytes;
+    int file_class;
+};
+
+struct magic_number MAGIC_NUMBERS[] = {
+    {0, 4, "\x7f" "ELF", CLASS_EXECUTABLE},
+    {0, 4, "\xcf\xfa\xed\xfe", CLASS_EXECUTABLE},   // Mach-O
+    {0, 4, "\xce\xfa\xed\xfe", CLASS_EXECUTABLE},
+    {0, 4, "\xca\xfe\xba\xbe", CLASS_EXECUTABLE},   // universal binaries, Java classes
+    {0, 8, "\x89PNG\r\n\x1a\n", CLASS_IMAGE},
+    {0, 3, "\xff\xd8\xff", CLASS_IMAGE},
+    {0, 6, "GIF87a", CLASS_IMAGE},
+    {0, 6, "GIF89a", CLASS_IMAGE},
+    {8, 7, "WEBPVP8", CLASS_IMAGE},
+    {0, 4, "II*\0", CLASS_IMAGE},
+    {0, 4, "MM\0*", CLASS_IMAGE},
+    {0, 5, "%PDF-", CLASS_DOCUMENT},
+    {0, 4, "PK\x03\x04", CLASS_ARCHIVE},
+    {0, 2, "\x1f\x8b", CLASS_ARCHIVE},
+    {0, 6, "\xfd" "7zXZ\0", CLASS_ARCHIVE},
+    {0, 4, "\x28\xb5\x2f\xfd", CLASS_ARCHIVE},      // zstd
+    {0, 6, "7z\xbc\xaf\x27\x1c", CLASS_ARCHIVE},
+    {0, 6, "Rar!\x1a\x07", CLASS_ARCHIVE},
+    {257, 5, "ustar", CLASS_ARCHIVE},
+};
+
+struct classification
+{
+    int file_class;
+    int language;
+};
+
+struct class_cache_slot
+{
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    off_t base;
+    struct classification result;   // CLASS_UNKNOWN while the slot is free
+};
+
+struct class_cache_slot class_cache[CLASS_CACHE_SIZE];
+
+// true when the 16 bytes at p are printable ASCII, tabs or line breaks,
+// which lets text skip the byte by byte checks
+static bool is_plain_chunk(const unsigned char *p) {
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+    __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    // the sign bit of v itself marks bytes >= 0x80
+    return (_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_andnot_si128(space, low))) == 0;
+#elif defined(__ARM_NEON)
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t space = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\t')), vceqq_u8(v, vdupq_n_u8('\n'))),
+                                vceqq_u8(v, vdupq_n_u8('\r')));
+    uint8x16_t control = vbicq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), space);
+    return vmaxvq_u8(v) < 0x80 && vmaxvq_u8(control) == 0;
+#else
+    for (int i = 0; i < 16; i++) {
+        if ((p[i] < 0x20 && p[i] != '\t' && p[i] != '\n' && p[i] != '\r') || p[i] >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+// control characters that still show up in text: whitespace, backspace
+// in man pages and escape in colored logs
+static bool is_text_control(unsigned char c) {
+    return (c >= '\b' && c <= '\r') || c == 0x1b;
+}
+
+int classify_sample(const unsigned char *sample, size_t len) {
+    int n_magic = sizeof(MAGIC_NUMBERS) / sizeof(MAGIC_NUMBERS[0]);
+    size_t control = 0, invalid = 0;
+    size_t i = 0;
+
+    if (len == 0) {
+        return CLASS_EMPTY;
+    }
+    for (int m = 0; m < n_magic; m++) {
+        const struct magic_number *magic = &MAGIC_NUMBERS[m];
+        if (magic->offset + magic->len <= (int) len &&
+            memcmp(sample + magic->offset, magic->bytes, magic->len) == 0) {
+            return magic->file_class;
+        }
+    }
+
+    while (i < len) {
+        if (i + 16 <= len && is_plain_chunk(sample + i)) {
+            i += 16;
+            continue;
+        }
+        unsigned char c = sample[i];
+        if (c == 0) {
+            return CLASS_BINARY;
+        }
+        if (c < 0x80) {
+            if ((c < 0x20 && !is_text_control(c)) || c == 0x7f) {
+                control++;
+            }
+            i++;
+            continue;
+        }
+
+        int n = 0;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 3;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 4;
+        }
+        if (n == 0) {
+            invalid++;
+            i++;
+            continue;
+        }
+        if (i + n > len) {
+            break; // cut by the end of the sample
+        }
+        int k = 1;
+        while (k < n && (sample[i + k] & 0xc0) == 0x80) {
+            k++;
+        }
+        if (k < n) {
+            invalid++;
+            i++;
+            continue;
+        }
+        i += n;
+    }
+
+    // a few stray bytes are fine, they are usually latin-1 text
+    if (control * 32 > len || invalid * 16 > len) {
+        return CLASS_BINARY;
+    }
+    return CLASS_TEXT;
+}
+
+// language of a script by the interpreter on its #! line
+int get_shebang_language(const unsigned char *sample, size_t len) {
+    char line[128];
+    size_t n = 0;
+
+    if (len < 2 || sample[0] != '#' || sample[1] != '!') {
+        return LANG_NONE;
+    }
+    while (n + 2 < len && n < sizeof(line) - 1 && sample[n + 2] != '\n') {
+        line[n] = sample[n + 2];
+        n++;
+    }
+    line[n] = '\0';
+
+    char *rest = line;
+    char *word;
+    char *interpreter = NULL;
+    while ((word = strsep(&rest, " \t")) != NULL) {
+        if (word[0] == '\0' || (interpreter != NULL && word[0] == '-')) {
+            continue;
+        }
+        char *slash = strrchr(word, '/');
+        interpreter = slash ? slash + 1 : word;
+        if (!equal_strings(interpreter, "env")) {
+            break;
+        }
+    }
+    if (interpreter == NULL) {
+        return LANG_NONE;
+    }
+    if (strncmp(interpreter, "python", 6) == 0) {
+        return LANG_PYTHON;
+    }
+    if (equal_strings(interpreter, "sh") || equal_strings(interpreter, "bash") ||
+        equal_strings(interpreter, "zsh") || equal_strings(interpreter, "dash") ||
+        equal_strings(interpreter, "ksh")) {
+        return LANG_SHELL;
+    }
+    return LANG_NONE;
+}
+
+// classifies length bytes of file starting at base, -1 meaning up to the
+// end, reading only when the cache has nothing for that inode and mtime
+struct classification classify_file(const char *file, dev_t dev, ino_t ino, int64_t mtime,
+                                     off_t base, off_t length) {
+    uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) ino * 0xc2b2ae3d27d4eb4fULL) ^ (uint64_t) base;
+    struct class_cache_slot *slot = &class_cache[(h ^ (h >> 29)) % CLASS_CACHE_SIZE];
+    struct classification result = {CLASS_OTHER, LANG_NONE};
+
+    if (slot->result.file_class != CLASS_UNKNOWN && slot->dev == dev && slot->ino == ino &&
+        slot->mtime == mtime && slot->base == base) {
+        return slot->result;
+    }
+
+    unsigned char sample[CLASSIFY_SAMPLE];
+    size_t want = length >= 0 && length < CLASSIFY_SAMPLE ? (size_t) length : CLASSIFY_SAMPLE;
+    ssize_t got = 0;
+    if (want > 0) {
+        int fd = open(file, O_RDONLY);
+        if (fd < 0) {
+            return result; // unreadable, and maybe not for long: not cached
+        }
+        got = pread(fd, sample, want, base);
+        close(fd);
+        if (got < 0) {
+            return result;
+        }
+    }
+
+    result.file_class = classify_sample(sample, got);
+    if (result.file_class == CLASS_TEXT) {
+        result.language = get_shebang_language(sample, got);
+    }
+    *slot = (struct class_cache_slot){dev, ino, mtime, base, result};
+    return result;
+}
+
+// class of the file at path following symlinks, and the language to
+// highlight it with, which the extension decides before the #! line
+struct classification classify_path(const char *path) {
+    struct stat st;
+    struct classification result = {CLASS_OTHER, LANG_NONE};
+
+    if (stat(path, &st) != 0) {
+        return result;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        result.file_class = CLASS_DIRECTORY;
+        return result;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return result;
+    }
+    result = classify_file(path, st.st_dev, st.st_ino, get_mtime_ns(&st), 0, st.st_size);
+    if (result.file_class == CLASS_TEXT && get_language(path) != LANG_NONE) {
+        result.language = get_language(path);
+    }
+    return result;
+}
+
+struct classification classify_member(struct tar_index *tar, int member) {
+    struct tar_member *m = &tar->members[member];
+    struct classification result = {CLASS_OTHER, LANG_NONE};
+
+    if (S_ISDIR(m->mode)) {
+        result.file_class = CLASS_DIRECTORY;
+        return result;
+    }
+    if (!S_ISREG(m->mode)) {
+        return result;
+    }
+    result = classify_file(tar->archive, tar->dev, tar->ino, tar->mtime, m->data_offset, m->size);
+    if (result.file_class == CLASS_TEXT && get_language(m->name) != LANG_NONE) {
+        result.language = get_language(m->name);
+    }
+    return result;
+}
+
+// class of an entry of block, worked out the first time it is drawn
+int get_entry_class(struct dirblock *block, int index) {
+    struct entry *e = &block->files[index];
+
+    if (e->file_class != CLASS_UNKNOWN) {
+        return e->file_class;
+    }
+    if (block->archive != NULL) {
+        int member = tar_lookup(block->archive, block->archive_dir, e->name);
+        e->file_class = member >= 0 ? classify_member(block->archive, member).file_class : CLASS_OTHER;
+    } else {
+        char *path = get_new_path(block->path, e->name);
+        e->file_class = path ? classify_path(path).file_class : CLASS_OTHER;
+        free(path);
+    }
+    return e->file_class;
+}
+
+// Git status. .git/index is mapped and parsed once per change of its
+// mtime; an entry is modified when the stat data cached in the index no
+// longer matches the file, without hashing anything. Files missing from
+// the index are untracked or ignored, following the .gitignore files on
+// the way down. A worker compares the blob ids of the index with the tree
+// of HEAD to find what is staged, then rolls up the most pressing state
+// below each directory; until it is done those marks stay blank.
+
+#define GIT_CACHE_SIZE       4
+#define GIT_ROOT_CACHE_SIZE  16
+#define GIT_RECHECK_NS       1000000000LL   // how long a repository lookup is trusted
+
+enum git_status
+{
+    GIT_UNKNOWN,            // not looked up yet
+    GIT_CLEAN,
+    GIT_IGNORED,
+    GIT_UNTRACKED,
+    GIT_STAGED,
+    GIT_MODIFIED,
+    GIT_CONFLICT,
+};
+
+char GIT_MARKS[] = {' ', ' ', '!', '?', '+', 'M', 'U'};
+int GIT_COLORS[] = {0, 0, 5, 4, 2, 3, 3};
+
+struct git_entry
+{
+    const char *path;       // relative to the work tree
+    int64_t mtime;
+    off_t size;
+    ino_t ino;
+    mode_t mode;
+    int stage;              // non-zero for conflicts
+    unsigned char oid[32];  // blob id, hash_len bytes of it
+};
+
+struct git_ignore
+{
+    const char *base;       // directory of the .gitignore, "" at the top
+    char *pattern;
+    bool negate;
+    bool dir_only;
+    bool anchored;          // matched against the path below base, not the name
+};
+
+struct git_dir_status
+{
+    char *path;             // relative to the work tree, NULL in a free slot
+    int status;
+};
+
+struct git_repo
+{
+    char *root;             // work tree
+    char *git_dir;
+    int64_t index_mtime;
+    int64_t checked;        // when index_mtime was last compared with the file
+    unsigned long generation;   // changes with every load and rollup
+    int hash_len;
+    struct git_entry *entries;
+    int n_entries;
+    char *names;
+    struct git_ignore *ignores;
+    int n_ignores;
+    char **ignore_dirs;     // directories whose .gitignore was read
+    int n_ignore_dirs;
+    unsigned long last_used;
+    pthread_mutex_t lock;   // guards the ignore rules and the rollup
+    pthread_t rollup_thread;
+    bool rollup_started;
+    bool rollup_done;
+    volatile bool cancel;
+    struct git_dir_status *dirs;    // hash table of the state below each directory
+    int n_dir_slots;
+    bool *staged;           // per entry, NULL when HEAD could not be read
+};
+
+struct git_repo git_repos[GIT_CACHE_SIZE];
+unsigned long git_clock = 0;
+
+struct git_root
+{
+    char *path;             // directory of a block
+    char *root;             // its work tree, NULL outside repositories
+    int64_t checked;
+};
+
+struct git_root git_roots[GIT_ROOT_CACHE_SIZE];
+int next_git_root = 0;
+unsigned long git_generation = 0;
+bool git_rollup_published = false;  // a rollup finished since the last redraw
+
+static uint32_t read_be32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// git's offset varint, used by index v4 for the shared prefix length
+static uint64_t read_git_varint(const unsigned char **p, const unsigned char *end) {
+    uint64_t value = 0;
+    if (*p >= end) {
+        return 0;
+    }
+    unsigned char c = *(*p)++;
+    value = c & 0x7f;
+    while ((c & 0x80) && *p < end) {
+        c = *(*p)++;
+        value = ((value + 1) << 7) | (c & 0x7f);
+    }
+    return value;
+}
+
+static void free_git_repo(struct git_repo *repo) {
+    if (repo->rollup_started) {
+        repo->cancel = true;
+        pthread_join(repo->rollup_thread, NULL);
+    }
+    if (repo->root != NULL) {
+        pthread_mutex_destroy(&repo->lock);
+    }
+    for (int i = 0; i < repo->n_dir_slots; i++) {
+        free(repo->dirs[i].path);
+    }
+    free(repo->dirs);
+    free(repo->staged);
+    free(repo->root);
+    free(repo->git_dir);
+    free(repo->entries);
+    free(repo->names);
+    for (int i = 0; i < repo->n_ignores; i++) {
+        free(repo->ignores[i].pattern);
+    }
+    free(repo->ignores);
+    for (int i = 0; i < repo->n_ignore_dirs; i++) {
+        free(repo->ignore_dirs[i]);
+    }
+    free(repo->ignore_dirs);
+    memset(repo, 0, sizeof(*repo));
+}
+
+// Parses an index of version 2, 3 or 4. The paths are copied out so the
+// mapping is dropped right away.
+static bool parse_git_index(struct git_repo *repo, const unsigned char *data, size_t len, int hash_len) {
+    if (len < 12 || memcmp(data, "DIRC", 4) != 0) {
+        return false;
+    }
+    uint32_t version = read_be32(data + 4);
+    uint32_t count = read_be32(data + 8);
+    if (version < 2 || version > 4) {
+        return false;
+    }
+
+    // paths never take more room than the index itself
+    repo->entries = malloc(sizeof(struct git_entry) * (count > 0 ? count : 1));
+    repo->names = malloc(len + 1);
+    size_t names_len = 0;
+    const unsigned char *p = data + 12, *end = data + len;
+    const char *previous = "";
+    size_t fixed = 40 + hash_len + 2;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if ((size_t) (end - p) < fixed) {
+            return false;
+        }
+        struct git_entry *e = &repo->entries[repo->n_entries];
+        const unsigned char *start = p;
+        e->mtime = (int64_t) read_be32(p + 8) * 1000000000 + read_be32(p + 12);
+        e->ino = read_be32(p + 20);
+        e->mode = read_be32(p + 24);
+        e->size = read_be32(p + 36);
+        uint16_t flags = (uint16_t) (p[40 + hash_len] << 8 | p[41 + hash_len]);
+        e->stage = (flags >> 12) & 3;
+        memcpy(e->oid, p + 40, hash_len);
+        p += fixed;
+        if (version >= 3 && (flags & 0x4000)) {
+            p += 2;
+        }
+
+        char *name = repo->names + names_len;
+        if (version == 4) {
+            size_t strip = read_git_varint(&p, end);
+            size_t kept = strlen(previous) > strip ? strlen(previous) - strip : 0;
+            const unsigned char *nul = memchr(p, '\0', end - p);
+            if (nul == NULL || names_len + kept + (nul - p) + 1 > len) {
+                return false;
+            }
+            memmove(name, previous, kept);
+            memcpy(name + kept, p, nul - p + 1);
+            p = nul + 1;
+        } else {
+            const unsigned char *nul = memchr(p, '\0', end - p);
+            if (nul == NULL) {
+                return false;
+            }
+            memcpy(name, p, nul - p + 1);
+            // entries are padded with 1 to 8 NULs to a multiple of 8 bytes
+            p = start + ((p - start + (nul - p) + 8) & ~(size_t) 7);
+        }
+        e->path = name;
+        names_len += strlen(name) + 1;
+        previous = name;
+        repo->n_entries++;
+    }
+    return true;
+}
+
+// the directory holding the repository of root, following a .git file
+static char *get_git_dir(const char *root) {
+    struct stat st;
+    char *dot_git = get_new_path((char *) root, ".git");
+
+    if (stat(dot_git, &st) != 0) {
+        free(dot_git);
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return dot_git;
+    }
+
+    // worktrees and submodules: "gitdir: <path>"
+    char line[PATH_MAX + 16];
+    FILE *file = fopen(dot_git, "r");
+    free(dot_git);
+    if (file == NULL || fgets(line, sizeof(line), file) == NULL || strncmp(line, "gitdir: ", 8) != 0) {
+        if (file) {
+            fclose(file);
+        }
+        return NULL;
+    }
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+    return line[8] == '/' ? strdup(line + 8) : get_new_path((char *) root, line + 8);
+}
+
+// work tree holding path, NULL outside repositories
+static char *find_git_root(const char *path) {
+    char *dir = strdup(path);
+
+    while (1) {
+        char *dot_git = get_new_path(dir, ".git");
+        bool found = access(dot_git, F_OK) == 0;
+        free(dot_git);
+        if (found) {
+            return dir;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            free(dir);
+            return NULL;
+        }
+        *slash = '\0';
+    }
+}
+
+// reads the patterns of dir/.gitignore, or of the exclude file for NULL
+static void load_git_ignores(struct git_repo *repo, const char *dir) {
+    const char *base = "";
+    char *path;
+    char line[PATH_MAX];
+
+    if (dir == NULL) {
+        path = get_new_path(repo->git_dir, "info/exclude");
+    } else {
+        for (int i = 0; i < repo->n_ignore_dirs; i++) {
+            if (equal_strings(repo->ignore_dirs[i], dir)) {
+                return;
+            }
+        }
+        repo->ignore_dirs = realloc(repo->ignore_dirs, sizeof(char *) * (repo->n_ignore_dirs + 1));
+        repo->ignore_dirs[repo->n_ignore_dirs++] = strdup(dir);
+        base = repo->ignore_dirs[repo->n_ignore_dirs - 1];
+        char *full = dir[0] ? get_new_path(repo->root, (char *) dir) : strdup(repo->root);
+        path = get_new_path(full, ".gitignore");
+        free(full);
+    }
+    FILE *file = fopen(path, "r");
+    free(path);
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        size_t len = strcspn(line, "\r\n");
+        while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) {
+            len--;
+        }
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        struct git_ignore rule = {base, NULL, false, false, false};
+        char *p = line;
+        if (*p == '!') {
+            rule.negate = true;
+            p++;
+        } else if (*p == '\\') {
+            p++;
+        }
+        len = strlen(p);
+        if (len > 0 && p[len - 1] == '/') {
+            rule.dir_only = true;
+            p[--len] = '\0';
+        }
+        if (strncmp(p, "**/", 3) == 0 && strchr(p + 3, '/') == NULL) {
+            p += 3; // the same as no slash at all
+        }
+        rule.anchored = strchr(p, '/') != NULL;
+        if (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        rule.pattern = strdup(p);
+        repo->ignores = realloc(repo->ignores, sizeof(struct git_ignore) * (repo->n_ignores + 1));
+        repo->ignores[repo->n_ignores++] = rule;
+    }
+    fclose(file);
+}
+
+static bool load_git_repo(struct git_repo *repo, const char *root) {
+    struct stat st;
+    repo->root = strdup(root);
+    pthread_mutex_init(&repo->lock, NULL);
+    repo->checked = get_monotonic_ns();
+    repo->hash_len = 20;
+    repo->git_dir = get_git_dir(root);
+    if (repo->git_dir == NULL) {
+        return false;
+    }
+
+    char *index_path = get_new_path(repo->git_dir, "index");
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    free(index_path);
+    if (fd < 0) {
+        return true; // a fresh repository: everything is untracked
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    repo->index_mtime = get_mtime_ns(&st);
+
+    // SHA-256 repositories say so in their config
+    int hash_len = 20;
+    char *config_path = get_new_path(repo->git_dir, "config");
+    FILE *config = fopen(config_path, "r");
+    free(config_path);
+    if (config) {
+        char line[256];
+        while (fgets(line, sizeof(line), config)) {
+            if (strstr(line, "objectformat") && strstr(line, "sha256")) {
+                hash_len = 32;
+            }
+        }
+        fclose(config);
+    }
+
+    repo->hash_len = hash_len;
+    bool ok = st.st_size == 0;
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            ok = parse_git_index(repo, data, st.st_size, hash_len);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+
+    load_git_ignores(repo, NULL);
+    return ok;
+}
+
+// mtime of the index in git_dir, 0 when there is none
+static int64_t get_git_index_mtime(const char *git_dir) {
+    struct stat st;
+    char *index_path = get_new_path((char *) git_dir, "index");
+    int64_t mtime = stat(index_path, &st) == 0 ? get_mtime_ns(&st) : 0;
+    free(index_path);
+    return mtime;
+}
+
+// work tree holding the directory of a block, looked up again once the
+// answer is older than GIT_RECHECK_NS
+static const char *get_block_git_root(const char *path) {
+    int64_t now = get_monotonic_ns();
+    struct git_root *slot = NULL;
+
+    for (int i = 0; i < GIT_ROOT_CACHE_SIZE; i++) {
+        if (git_roots[i].path != NULL && equal_strings(git_roots[i].path, path)) {
+            if (now - git_roots[i].checked < GIT_RECHECK_NS) {
+                return git_roots[i].root;
+            }
+            slot = &git_roots[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = &git_roots[next_git_root];
+        next_git_root = (next_git_root + 1) % GIT_ROOT_CACHE_SIZE;
+    }
+    free(slot->path);
+    free(slot->root);
+    *slot = (struct git_root){strdup(path), find_git_root(path), now};
+    return slot->root;
+}
+
+static void *git_rollup_worker(void *arg);
+
+// The cached repository holding path, parsed again when its index changed.
+struct git_repo *get_git_repo(const char *path) {
+    const char *root = get_block_git_root(path);
+    struct git_repo *lru = &git_repos[0];
+    int64_t now = get_monotonic_ns();
+
+    if (root == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < GIT_CACHE_SIZE; i++) {
+        struct git_repo *repo = &git_repos[i];
+        if (repo->root && equal_strings(repo->root, root)) {
+            if (now - repo->checked >= GIT_RECHECK_NS) {
+                if (get_git_index_mtime(repo->git_dir) != repo->index_mtime) {
+                    lru = repo;
+                    break;
+                }
+                repo->checked = now;
+            }
+            repo->last_used = ++git_clock;
+            return repo;
+        }
+        if (repo->last_used < lru->last_used) {
+            lru = repo;
+        }
+    }
+
+    free_git_repo(lru);
+    if (!load_git_repo(lru, root)) {
+        free_git_repo(lru);
+        return NULL;
+    }
+    lru->generation = __atomic_add_fetch(&git_generation, 1, __ATOMIC_RELAXED);
+    if (bn.replaying) {
+        // marks in a replayed frame must not depend on when a worker finishes
+        git_rollup_worker(lru);
+    } else {
+        lru->rollup_started = pthread_create(&lru->rollup_thread, NULL, git_rollup_worker, lru) == 0;
+    }
+    lru->last_used = ++git_clock;
+    return lru;
+}
+
+// whether rel itself matches the rules, the last matching rule winning
+static bool matches_git_ignores(struct git_repo *repo, const char *rel, bool is_dir) {
+    bool ignored = false;
+    const char *name = strrchr(rel, '/') ? strrchr(rel, '/') + 1 : rel;
+
+    for (int i = 0; i < repo->n_ignores; i++) {
+        struct git_ignore *rule = &repo->ignores[i];
+        size_t base_len = strlen(rule->base);
+        if (base_len > 0 && (strncmp(rel, rule->base, base_len) != 0 || rel[base_len] != '/')) {
+            continue;
+        }
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+        const char *below = base_len > 0 ? rel + base_len + 1 : rel;
+        if (rule->anchored ? fnmatch(rule->pattern, below, FNM_PATHNAME) == 0 : fnmatch(rule->pattern, name, 0) == 0) {
+            ignored = !rule->negate;
+        }
+    }
+    return ignored;
+}
+
+// Whether rel or a directory above it is ignored. The .gitignore files of
+// every directory on the way are read the first time they are needed.
+static bool is_git_ignored(struct git_repo *repo, const char *rel, bool is_dir) {
+    char *prefix = strdup(rel);
+    bool ignored = false;
+
+    load_git_ignores(repo, "");
+    for (char *slash = strchr(prefix, '/'); slash && !ignored; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        ignored = matches_git_ignores(repo, prefix, true);
+        load_git_ignores(repo, prefix);
+        *slash = '/';
+    }
+    free(prefix);
+    return ignored || matches_git_ignores(repo, rel, is_dir);
+}
+
+static int compare_git_path(const void *key, const void *entry) {
+    return strcmp(key, ((const struct git_entry *) entry)->path);
+}
+
+// first index entry not sorting before rel
+static int git_lower_bound(struct git_repo *repo, const char *rel) {
+    int low = 0, high = repo->n_entries;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(repo->entries[mid].path, rel) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// compares the stat data cached in the index with the file
+static int get_git_entry_status(struct git_repo *repo, struct git_entry *e) {
+    struct stat st;
+
+    if (e->stage != 0) {
+        return GIT_CONFLICT;
+    }
+    if ((e->mode & S_IFMT) == 0160000) {
+        return GIT_CLEAN; // submodules are repositories of their own
+    }
+    char *path = get_new_path(repo->root, (char *) e->path);
+    int failed = lstat(path, &st);
+    free(path);
+    // the index keeps the low 32 bits of the size and inode
+    if (failed != 0 || get_mtime_ns(&st) != e->mtime || (uint32_t) st.st_size != (uint32_t) e->size ||
+        (uint32_t) st.st_ino != (uint32_t) e->ino || (st.st_mode & S_IFMT) != (e->mode & S_IFMT) ||
+        ((st.st_mode & 0100) != 0) != ((e->mode & 0100) != 0)) {
+        return GIT_MODIFIED;
+    }
+    return GIT_CLEAN;
+}
+
+// Object store, read just far enough to list the blobs of HEAD: loose
+// objects and version 2 pack indexes, with both kinds of deltas.
+
+#define GIT_OBJ_COMMIT     1
+#define GIT_OBJ_TREE       2
+#define GIT_OBJ_OFS_DELTA  6
+#define GIT_OBJ_REF_DELTA  7
+#define GIT_DELTA_DEPTH    64
+
+struct git_pack
+{
+    unsigned char *idx;
+    size_t idx_len;
+    unsigned char *data;
+    size_t data_len;
+    uint32_t count;
+};
+
+struct git_objects
+{
+    char *dir;
+    int hash_len;
+    struct git_pack *packs;
+    int n_packs;
+};
+
+struct git_blob
+{
+    char *path;
+    unsigned char oid[32];
+};
+
+// maps the whole of path read-only, NULL when that fails
+static unsigned char *map_git_file(const char *path, size_t *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    void *data = MAP_FAILED;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *len = st.st_size;
+    }
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// the directory shared by every worktree of the repository in git_dir
+static char *get_git_common_dir(const char *git_dir) {
+    char line[PATH_MAX];
+    char *path = get_new_path((char *) git_dir, "commondir");
+    FILE *file = fopen(path, "r");
+    free(path);
+
+    if (file == NULL) {
+        return strdup(git_dir);
+    }
+    bool read = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+    if (!read || line[0] == '\0') {
+        return strdup(git_dir);
+    }
+    return line[0] == '/' ? strdup(line) : get_new_path((char *) git_dir, line);
+}
+
+static void open_git_objects(struct git_objects *objects, const char *common_dir, int hash_len) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+
+    memset(objects, 0, sizeof(*objects));
+    objects->dir = get_new_path((char *) common_dir, "objects");
+    objects->hash_len = hash_len;
+    snprintf(path, PATH_MAX, "%s/pack", objects->dir);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || !equal_strings(entry->d_name + len - 4, ".idx")) {
+            continue;
+        }
+        struct git_pack pack = {0};
+        snprintf(path, PATH_MAX, "%s/pack/%s", objects->dir, entry->d_name);
+        pack.idx = map_git_file(path, &pack.idx_len);
+        snprintf(path, PATH_MAX, "%s/pack/%.*s.pack", objects->dir, (int) len - 4, entry->d_name);
+        pack.data = map_git_file(path, &pack.data_len);
+        if (pack.idx == NULL || pack.data == NULL || pack.idx_len < 8 + 256 * 4 ||
+            memcmp(pack.idx, "\377tOc", 4) != 0 || read_be32(pack.idx + 4) != 2) {
+            if (pack.idx) {
+                munmap(pack.idx, pack.idx_len);
+            }
+            if (pack.data) {
+                munmap(pack.data, pack.data_len);
+            }
+            continue;
+        }
+        pack.count = read_be32(pack.idx + 8 + 255 * 4);
+        objects->packs = realloc(objects->packs, sizeof(struct git_pack) * (objects->n_packs + 1));
+        objects->packs[objects->n_packs++] = pack;
+    }
+    closedir(dir);
+}
+
+static void close_git_objects(struct git_objects *objects) {
+    for (int i = 0; i < objects->n_packs; i++) {
+        munmap(objects->packs[i].idx, objects->packs[i].idx_len);
+        munmap(objects->packs[i].data, objects->packs[i].data_len);
+    }
+    free(objects->packs);
+    free(objects->dir);
+}
+
+// Inflates the zlib stream at in. expected sizes the buffer, which grows
+// when it is 0 or wrong. Returns NULL on a corrupt stream.
+static unsigned char *inflate_git_data(const unsigned char *in, size_t in_len, size_t expected, size_t *out_len) {
+    size_t cap = expected > 0 ? expected : 4096;
+    unsigned char *out = malloc(cap + 1);
+    z_stream z = {0};
+    int result = Z_OK;
+
+    if (inflateInit(&z) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    z.next_in = (unsigned char *) in;
+    z.avail_in = in_len > UINT_MAX ? UINT_MAX : in_len;
+    while (result == Z_OK) {
+        if (z.total_out == cap) {
+            cap *= 2;
+            out = realloc(out, cap + 1);
+        }
+        z.next_out = out + z.total_out;
+        z.avail_out = cap - z.total_out;
+        result = inflate(&z, Z_NO_FLUSH);
+    }
+    *out_len = z.total_out;
+    inflateEnd(&z);
+    if (result != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    out[*out_len] = '\0';
+    return out;
+}
+
+static size_t read_delta_size(const unsigned char **p, const unsigned char *end) {
+    size_t size = 0;
+    int shift = 0;
+    while (*p < end) {
+        unsigned char c = *(*p)++;
+        size |= (size_t) (c & 0x7f) << shift;
+        shift += 7;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    return size;
+}
+
+// rebuilds an object from its base and a delta of copies and inserts
+static unsigned char *apply_git_delta(const unsigned char *base, size_t base_len,
+                                      const unsigned char *delta, size_t delta_len, size_t *out_len) {
+    const unsigned char *p = delta, *end = delta + delta_len;
+    if (read_delta_size(&p, end) != base_len) {
+        return NULL;
+    }
+    size_t size = read_delta_size(&p, end);
+    unsigned char *out = malloc(size + 1);
+    size_t n = 0;
+
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            size_t offset = 0, len = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) {
+                    offset |= (size_t) (p < end ? *p++ : 0) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) {
+                    len |= (size_t) (p < end ? *p++ : 0) << (8 * i);
+                }
+            }
+            len = len ? len : 0x10000;
+            if (offset + len > base_len || n + len > size) {
+                free(out);
+                return NULL;
+            }
+            memcpy(out + n, base + offset, len);
+            n += len;
+        } else if (op > 0) {
+            if (op > end - p || n + op > size) {
+                free(out);
+                return NULL;
+            }
+            memcpy(out + n, p, op);
+            p += op;
+            n += op;
+        } else {
+            free(out);
+            return NULL;
+        }
+    }
+    if (n != size) {
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    *out_len = size;
+    return out;
+}
+
+static unsigned char *read_git_object(struct git_objects *objects, const unsigned char *oid,
+                                      int *type, size_t *size, int depth);
+
+// the object at offset in pack, resolving its delta chain
+static unsigned char *read_packed_object(struct git_objects *objects, struct git_pack *pack, uint64_t offset,
+                                         int *type, size_t *size, int depth) {
+    if (depth > GIT_DELTA_DEPTH || offset >= pack->data_len) {
+        return NULL;
+    }
+    const unsigned char *p = pack->data + offset, *end = pack->data + pack->data_len;
+    unsigned char c = *p++;
+    int kind = (c >> 4) & 7;
+    size_t len = c & 15;
+    for (int shift = 4; (c & 0x80) && p < end; shift += 7) {
+        c = *p++;
+        len |= (size_t) (c & 0x7f) << shift;
+    }
+
+    unsigned char *base = NULL;
+    size_t base_len;
+    if (kind == GIT_OBJ_OFS_DELTA) {
+        // the base sits this far back in the same pack
+        uint64_t back = read_git_varint(&p, end);
+        if (back == 0 || back > offset) {
+            return NULL;
+        }
+        base = read_packed_object(objects, pack, offset - back, type, &base_len, depth + 1);
+    } else if (kind == GIT_OBJ_REF_DELTA) {
+        if (end - p < objects->hash_len) {
+            return NULL;
+        }
+        base = read_git_object(objects, p, type, &base_len, depth + 1);
+        p += objects->hash_len;
+    } else {
+        *type = kind;
+        return inflate_git_data(p, end - p, len, size);
+    }
+    if (base == NULL) {
+        return NULL;
+    }
+
+    size_t delta_len;
+    unsigned char *delta = inflate_git_data(p, end - p, len, &delta_len);
+    unsigned char *object = delta ? apply_git_delta(base, base_len, delta, delta_len, size) : NULL;
+    free(delta);
+    free(base);
+    return object;
+}
+
+// contents of the object named oid, its type in *type
+static unsigned char *read_git_object(struct git_objects *objects, const unsigned char *oid,
+                                      int *type, size_t *size, int depth) {
+    int hash_len = objects->hash_len;
+
+    for (int i = 0; i < objects->n_packs; i++) {
+        struct git_pack *pack = &objects->packs[i];
+        const unsigned char *fanout = pack->idx + 8;
+        uint32_t low = oid[0] > 0 ? read_be32(fanout + (oid[0] - 1) * 4) : 0;
+        uint32_t high = read_be32(fanout + oid[0] * 4);
+        const unsigned char *oids = fanout + 256 * 4;
+        if ((size_t) (oids - pack->idx) + (size_t) pack->count * (hash_len + 8) > pack->idx_len) {
+            continue;
+        }
+        while (low < high) {
+            uint32_t mid = (low + high) / 2;
+            int cmp = memcmp(oids + (size_t) mid * hash_len, oid, hash_len);
+            if (cmp == 0) {
+                const unsigned char *offsets = oids + (size_t) pack->count * (hash_len + 4);
+                uint64_t offset = read_be32(offsets + mid * 4);
+                if (offset & 0x80000000) {
+                    // index into the table of 8 byte offsets that follows
+                    const unsigned char *large = offsets + (size_t) pack->count * 4 + (offset & 0x7fffffff) * 8;
+                    if (large + 8 > pack->idx + pack->idx_len) {
+                        return NULL;
+                    }
+                    offset = (uint64_t) read_be32(large) << 32 | read_be32(large + 4);
+                }
+                return read_packed_object(objects, pack, offset, type, size, depth);
+            }
+            if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+
+    // loose: objects/ab/cdef..., "<type> <size>\0" then the contents
+    char path[PATH_MAX];
+    int n = snprintf(path, PATH_MAX, "%s/%02x/", objects->dir, oid[0]);
+    for (int i = 1; i < hash_len && n < PATH_MAX - 2; i++) {
+        n += snprintf(path + n, PATH_MAX - n, "%02x", oid[i]);
+    }
+    size_t file_len, len;
+    unsigned char *file = map_git_file(path, &file_len);
+    if (file == NULL) {
+        return NULL;
+    }
+    unsigned char *raw = inflate_git_data(file, file_len, 0, &len);
+    munmap(file, file_len);
+    unsigned char *nul = raw ? memchr(raw, '\0', len) : NULL;
+    if (nul == NULL) {
+        free(raw);
+        return NULL;
+    }
+    *type = strncmp((char *) raw, "commit ", 7) == 0 ? GIT_OBJ_COMMIT :
+            strncmp((char *) raw, "tree ", 5) == 0 ? GIT_OBJ_TREE : 0;
+    *size = len - (nul + 1 - raw);
+    memmove(raw, nul + 1, *size + 1);
+    return raw;
+}
+
+static bool parse_git_hex(const char *hex, unsigned char *oid, int hash_len) {
+    for (int i = 0; i < hash_len; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char) hex[2 * i]) || !isxdigit((unsigned char) hex[2 * i + 1]) ||
+            sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        oid[i] = byte;
+    }
+    return true;
+}
+
+// Commit HEAD points to, following one symbolic ref through loose and
+// packed refs. *unborn is set for a branch without commits yet.
+static bool read_git_head(const char *git_dir, const char *common_dir, int hash_len,
+                          unsigned char *oid, bool *unborn) {
+    char line[PATH_MAX + 16];
+    char *path = get_new_path((char *) git_dir, "HEAD");
+    FILE *file = fopen(path, "r");
+    free(path);
+
+    *unborn = false;
+    if (file == NULL || fgets(line, sizeof(line), file) == NULL) {
+        if (file) {
+            fclose(file);
+        }
+        return false;
+    }
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: ", 5) != 0) {
+        return parse_git_hex(line, oid, hash_len);
+    }
+
+    char ref[PATH_MAX];
+    snprintf(ref, sizeof(ref), "%s", line + 5);
+    path = get_new_path((char *) common_dir, ref);
+    file = fopen(path, "r");
+    free(path);
+    if (file != NULL) {
+        bool found = fgets(line, sizeof(line), file) != NULL && parse_git_hex(line, oid, hash_len);
+        fclose(file);
+        return found;
+    }
+
+    path = get_new_path((char *) common_dir, "packed-refs");
+    file = fopen(path, "r");
+    free(path);
+    bool found = false;
+    while (file != NULL && !found && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        found = line[0] != '#' && line[0] != '^' && strlen(line) > (size_t) hash_len * 2 &&
+                equal_strings(line + hash_len * 2 + 1, ref) && parse_git_hex(line, oid, hash_len);
+    }
+    if (file) {
+        fclose(file);
+    }
+    *unborn = !found;
+    return found;
+}
+
+static int compare_git_blobs(const void *a, const void *b) {
+    return strcmp(((const struct git_blob *) a)->path, ((const struct git_blob *) b)->path);
+}
+
+// Lists the blobs and submodules of the tree oid below prefix into *blobs.
+// Returns false when an object could not be read.
+static bool list_git_tree(struct git_repo *repo, struct git_objects *objects, const unsigned char *oid,
+                          const char *prefix, struct git_blob **blobs, int *n_blobs, int *cap) {
+    int type;
+    size_t len;
+    unsigned char *tree = read_git_object(objects, oid, &type, &len, 0);
+    bool ok = tree != NULL && type == GIT_OBJ_TREE;
+
+    // "<octal mode> <name>\0<hash>" per entry
+    for (unsigned char *p = tree, *end = tree + len; ok && p < end && !repo->cancel;) {
+        unsigned char *space = memchr(p, ' ', end - p);
+        unsigned char *nul = space ? memchr(space, '\0', end - space) : NULL;
+        if (nul == NULL || end - (nul + 1) < objects->hash_len) {
+            ok = false;
+            break;
+        }
+        unsigned long mode = strtoul((char *) p, NULL, 8);
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, prefix[0] ? "%s/%s" : "%s%s", prefix, (char *) space + 1);
+        if ((mode & S_IFMT) == S_IFDIR) {
+            ok = list_git_tree(repo, objects, nul + 1, path, blobs, n_blobs, cap);
+        } else {
+            if (*n_blobs == *cap) {
+                *cap = *cap ? *cap * 2 : 1024;
+                *blobs = realloc(*blobs, sizeof(struct git_blob) * *cap);
+            }
+            struct git_blob *blob = &(*blobs)[(*n_blobs)++];
+            blob->path = strdup(path);
+            memcpy(blob->oid, nul + 1, objects->hash_len);
+        }
+        p = nul + 1 + objects->hash_len;
+    }
+    free(tree);
+    return ok;
+}
+
+// Which index entries differ from HEAD, new files included. NULL when
+// HEAD or one of its trees could not be read.
+static bool *find_git_staged(struct git_repo *repo) {
+    char *common_dir = get_git_common_dir(repo->git_dir);
+    struct git_objects objects;
+    struct git_blob *blobs = NULL;
+    int n_blobs = 0, cap = 0;
+    unsigned char commit_oid[32], tree_oid[32];
+    bool unborn;
+    bool ok = false;
+
+    open_git_objects(&objects, common_dir, repo->hash_len);
+    if (read_git_head(repo->git_dir, common_dir, repo->hash_len, commit_oid, &unborn)) {
+        int type;
+        size_t len;
+        char *commit = (char *) read_git_object(&objects, commit_oid, &type, &len, 0);
+        ok = commit != NULL && type == GIT_OBJ_COMMIT && strncmp(commit, "tree ", 5) == 0 &&
+             parse_git_hex(commit + 5, tree_oid, repo->hash_len) &&
+             list_git_tree(repo, &objects, tree_oid, "", &blobs, &n_blobs, &cap);
+        free(commit);
+    } else {
+        ok = unborn; // nothing committed yet, so every entry is staged
+    }
+    close_git_objects(&objects);
+    free(common_dir);
+
+    bool *staged = NULL;
+    if (ok && !repo->cancel) {
+        qsort(blobs, n_blobs, sizeof(struct git_blob), compare_git_blobs);
+        staged = malloc(sizeof(bool) * (repo->n_entries > 0 ? repo->n_entries : 1));
+        for (int i = 0; i < repo->n_entries; i++) {
+            struct git_blob key = {(char *) repo->entries[i].path};
+            struct git_blob *blob = bsearch(&key, blobs, n_blobs, sizeof(struct git_blob), compare_git_blobs);
+            staged[i] = blob == NULL || memcmp(blob->oid, repo->entries[i].oid, repo->hash_len) != 0;
+        }
+    }
+    for (int i = 0; i < n_blobs; i++) {
+        free(blobs[i].path);
+    }
+    free(blobs);
+    return staged;
+}
+
+struct git_rollup
+{
+    struct git_dir_status *dirs;
+    int n_slots;
+    int n_dirs;
+};
+
+// the slot holding path in a table of n_slots, or the free one it would take
+static struct git_dir_status *find_git_dir_slot(struct git_dir_status *dirs, int n_slots, const char *path) {
+    uint32_t mask = n_slots - 1;
+    uint32_t i = hash_name(0, path) & mask;
+    while (dirs[i].path != NULL && !equal_strings(dirs[i].path, path)) {
+        i = (i + 1) & mask;
+    }
+    return &dirs[i];
+}
+
+// Raises every directory above path to status. Directories are always
+// raised together with those above them, so the walk up stops at the
+// first one already there.
+static void raise_git_dirs(struct git_rollup *r, const char *path, int status) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char *slash = strrchr(dir, '/'); slash != NULL; slash = strrchr(dir, '/')) {
+        *slash = '\0';
+        if ((r->n_dirs + 1) * 2 > r->n_slots) {
+            struct git_dir_status *grown = calloc(r->n_slots * 2, sizeof(struct git_dir_status));
+            for (int i = 0; i < r->n_slots; i++) {
+                if (r->dirs[i].path != NULL) {
+                    *find_git_dir_slot(grown, r->n_slots * 2, r->dirs[i].path) = r->dirs[i];
+                }
+            }
+            free(r->dirs);
+            r->dirs = grown;
+            r->n_slots *= 2;
+        }
+        struct git_dir_status *slot = find_git_dir_slot(r->dirs, r->n_slots, dir);
+        if (slot->path != NULL && slot->status >= status) {
+            return;
+        }
+        if (slot->path == NULL) {
+            *slot = (struct git_dir_status){strdup(dir), status};
+            r->n_dirs++;
+        }
+        slot->status = status;
+    }
+}
+
+// whether an index entry lies below the directory rel
+static bool has_git_entries_below(struct git_repo *repo, const char *rel) {
+    size_t rel_len = strlen(rel);
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/", rel);
+    int i = git_lower_bound(repo, prefix);
+    return i < repo->n_entries && strncmp(repo->entries[i].path, prefix, rel_len + 1) == 0;
+}
+
+// Walks the directory rel for files the index does not know, skipping
+// what is ignored and repositories of their own.
+static void find_git_untracked(struct git_repo *repo, struct git_rollup *r, const char *rel) {
+    char *full = rel[0] ? get_new_path(repo->root, (char *) rel) : strdup(repo->root);
+    DIR *dir = opendir(full);
+    free(full);
+    if (dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&repo->lock);
+    load_git_ignores(repo, rel);
+    pthread_mutex_unlock(&repo->lock);
+
+    struct dirent *entry;
+    struct stat st;
+    char child[PATH_MAX];
+    while (!repo->cancel && (entry = readdir(dir)) != NULL) {
+        if (equal_strings(entry->d_name, ".") || equal_strings(entry->d_name, "..") ||
+            (rel[0] == '\0' && equal_strings(entry->d_name, ".git"))) {
+            continue;
+        }
+        snprintf(child, sizeof(child), rel[0] ? "%s/%s" : "%s%s", rel, entry->d_name);
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (bsearch(child, repo->entries, repo->n_entries, sizeof(struct git_entry), compare_git_path)) {
+            continue; // a tracked file or submodule
+        }
+        pthread_mutex_lock(&repo->lock);
+        bool ignored = matches_git_ignores(repo, child, is_dir);
+        pthread_mutex_unlock(&repo->lock);
+        if (ignored) {
+            continue;
+        }
+        if (!is_dir) {
+            raise_git_dirs(r, child, GIT_UNTRACKED);
+            continue;
+        }
+        char dot_git[PATH_MAX + 8];
+        snprintf(dot_git, sizeof(dot_git), "%s/.git", entry->d_name);
+        if (!has_git_entries_below(repo, child) && faccessat(dirfd(dir), dot_git, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            // a nested repository shows as one untracked directory
+            snprintf(dot_git, sizeof(dot_git), "%s/", child);
+            raise_git_dirs(r, dot_git, GIT_UNTRACKED);
+            continue;
+        }
+        find_git_untracked(repo, r, child);
+    }
+    closedir(dir);
+}
+
+// Finds what is staged, rolls the state of every index entry and
+// untracked file up into the directories above it, then hands both to
+// repo.
+static void *git_rollup_worker(void *arg) {
+    struct git_repo *repo = arg;
+    struct git_rollup r = {calloc(64, sizeof(struct git_dir_status)), 64, 0};
+
+    set_low_priority();
+    bool *staged = find_git_staged(repo);
+    for (int i = 0; i < repo->n_entries && !repo->cancel; i++) {
+        int status = get_git_entry_status(repo, &repo->entries[i]);
+        if (status == GIT_CLEAN && staged != NULL && staged[i]) {
+            status = GIT_STAGED;
+        }
+        raise_git_dirs(&r, repo->entries[i].path, status);
+    }
+    find_git_untracked(repo, &r, "");
+
+    pthread_mutex_lock(&repo->lock);
+    repo->dirs = r.dirs;
+    repo->n_dir_slots = r.n_slots;
+    repo->staged = staged;
+    repo->rollup_done = true;
+    repo->generation = __atomic_add_fetch(&git_generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&repo->lock);
+    __atomic_store_n(&git_rollup_published, true, __ATOMIC_RELEASE);
+    wake_main_loop();
+    return NULL;
+}
+
+// Status of path, which lies in repo. A directory takes the most pressing
+// state below it from the rollup, GIT_UNKNOWN until that is done.
+int get_git_status(struct git_repo *repo, const char *path, bool is_dir) {
+    size_t root_len = strlen(repo->root);
+    const char *rel = path + root_len + (path[root_len] == '/');
+    int status;
+
+    if (path[root_len] != '/' || strcmp(rel, ".git") == 0 || strncmp(rel, ".git/", 5) == 0) {
+        return GIT_CLEAN;
+    }
+    struct git_entry *e = bsearch(rel, repo->entries, repo->n_entries, sizeof(struct git_entry), compare_git_path);
+    if (e != NULL) {
+        // a file, or a submodule; staged ones are known once the rollup is
+        status = get_git_entry_status(repo, e);
+        pthread_mutex_lock(&repo->lock);
+        if (status == GIT_CLEAN && repo->staged != NULL && repo->staged[e - repo->entries]) {
+            status = GIT_STAGED;
+        }
+        pthread_mutex_unlock(&repo->lock);
+        return status;
+    }
+
+    pthread_mutex_lock(&repo->lock);
+    if (!is_dir) {
+        status = is_git_ignored(repo, rel, false) ? GIT_IGNORED : GIT_UNTRACKED;
+    } else if (!repo->rollup_done) {
+        status = GIT_UNKNOWN;
+    } else {
+        struct git_dir_status *slot = find_git_dir_slot(repo->dirs, repo->n_dir_slots, rel);
+        if (slot->path != NULL) {
+            status = slot->status;
+        } else if (is_git_ignored(repo, rel, true)) {
+            status = GIT_IGNORED;
+        } else {
+            // created since the rollup, or holding nothing git would list
+            status = has_git_entries_below(repo, rel) ? GIT_CLEAN : GIT_UNTRACKED;
+        }
+    }
+    pthread_mutex_unlock(&repo->lock);
+    return status;
+}
+
+// git status of an entry of block, looked up the first time it is drawn
+int get_entry_git_status(struct dirblock *block, struct git_repo *repo, int index) {
+    struct entry *e = &block->files[index];
+
+    if (e->git_status == GIT_UNKNOWN) {
+        char *path = get_new_path(block->path, e->name);
+        e->git_status = path ? get_git_status(repo, path, get_entry_class(block, index) == CLASS_DIRECTORY) : GIT_CLEAN;
+        free(path);
+    }
+    return e->git_status;
+}
+
+void print_block(struct dirblock *block, int index)
+{
+
+    if (index != 1 && index != 0) {
+        return;
+    }
+
+    int column_size;
+    int column;
+
+    if (index == 0) {
+        column_size = (get_column_by_index(0) - 2) - 1;
+        column = 1;
+    } else if (index == 1) {
+        column_size = ((get_column_by_index(1) - 2) - 1) - ((get_column_by_index(0) - 2) - 1);
+        column = get_column_by_index(0) - 1;
+    }
+
+    int starting_row = wd.box_row + 1;
+    int box_height = (wd.bottom_bar_row - 1) - starting_row;
+    int loop_limit = block->n_files < box_height ? block->n_files : box_height;
+
+    // scroll only as far as needed to keep the selection visible
+    if (block->selected_index < block->offset) {
+        block->offset = block->selected_index;
+    } else if (block->selected_index > block->offset + box_height - 1) {
+        block->offset = block->selected_index - (box_height - 1);
+    }
+    if (block->offset > block->n_files - loop_limit) {
+        block->offset = block->n_files - loop_limit;
+    }
+    if (block->offset < 0) {
+        block->offset = 0;
+    }
+    int offset = block->offset;
+
+    // a new index or a finished rollup means every status may have changed
+    struct git_repo *repo = is_virtual_block(block) ? NULL : get_git_repo(block->path);
+    unsigned long generation = repo ? __atomic_load_n(&repo->generation, __ATOMIC_RELAXED) : 0;
+    if (repo != NULL && generation != block->git_generation) {
+        for (int i = 0; i < block->n_files; i++) {
+            block->files[i].git_status = GIT_UNKNOWN;
+        }
+        block->git_generation = generation;
+    }
+
+    for (int i = 0; i < loop_limit; i++) {
+        struct entry *e = &block->files[i + offset];
+        if (equal_strings(block->selected, e->name)) {
+            attron(COLOR_PAIR(1) | (e->marked ? A_BOLD : 0));
+            print_entry(starting_row, column, e, column_size);
+            attroff(COLOR_PAIR(1) | A_BOLD);
+        } else if (e->marked) {
+            attron(COLOR_PAIR(4) | A_BOLD);
+            print_entry(starting_row, column, e, column_size);
+            attroff(COLOR_PAIR(4) | A_BOLD);
+        } else if (block->duplicates && e->group % 2 == 1) {
+            // alternate colors so each duplicate set stands out
+            attron(COLOR_PAIR(7));
+            print_entry(starting_row, column, e, column_size);
+            attroff(COLOR_PAIR(7));
+        } else if (block->comparison) {
+            int pair = DIFF_COLORS[e->diff];
+            attron(COLOR_PAIR(pair));
+            print_entry(starting_row, column, e, column_size);
+            attroff(COLOR_PAIR(pair));
+        } else {
+            int pair = CLASS_COLORS[get_entry_class(block, i + offset)];
+            attron(COLOR_PAIR(pair));
+            print_entry(starting_row, column, e, column_size);
+            attroff(COLOR_PAIR(pair));
+        }
+        // the leading space carries the compare or git status
+        bool selected = equal_strings(block->selected, e->name);
+        if (block->comparison) {
+            mvaddch(starting_row, column, DIFF_MARKS[e->diff] | COLOR_PAIR(selected ? 1 : DIFF_COLORS[e->diff]));
+        } else if (repo != NULL) {
+            int status = get_entry_git_status(block, repo, i + offset);
+            mvaddch(starting_row, column, GIT_MARKS[status] | COLOR_PAIR(selected ? 1 : GIT_COLORS[status]));
+        }
+        starting_row++;
+    }
+}
+
+void print_blocks(struct dirblock *blocks, int block_q)
+{
+    if (block_q >= 2) {
+        print_block(&blocks[block_q - 1], 1);
+        print_block(&blocks[block_q - 2], 0);
+    } else if (block_q == 1) {
+        print_block(&blocks[0], 0);
+    }
+}
+
+// Hex viewer. Only the bytes on screen are mapped; moving around remaps
+// that window, so memory use does not depend on the size of the file.
+
+#define HEX_SEARCH_CHUNK (64 * 1024 * 1024)
+
+struct map_window
+{
+    int fd;
+    off_t origin;           // where offset 0 is in the file, for archive members
+    off_t file_size;
+    unsigned char *base;
+    size_t base_len;
+    unsigned char *data;    // first requested byte inside base
+    size_t len;
+};
+
+bool open_map_window(struct map_window *mw, const char *path) {
+    struct stat st;
+    memset(mw, 0, sizeof(*mw));
+    mw->fd = open(path, O_RDONLY);
+    if (mw->fd < 0) {
+        return false;
+    }
+    if (fstat(mw->fd, &st) != 0) {
+        close(mw->fd);
+        return false;
+    }
+    mw->file_size = st.st_size;
+    return true;
+}
+
+bool open_member_window(struct map_window *mw, struct tar_index *tar, int member) {
+    memset(mw, 0, sizeof(*mw));
+    mw->fd = open(tar->archive, O_RDONLY);
+    if (mw->fd < 0) {
+        return false;
+    }
+    mw->origin = tar->members[member].data_offset;
+    mw->file_size = tar->members[member].size;
+    return true;
+}
+
+void unmap_window(struct map_window *mw) {
+    if (mw->base) {
+        munmap(mw->base, mw->base_len);
+    }
+    mw->base = NULL;
+    mw->data = NULL;
+    mw->len = 0;
+}
+
+void close_map_window(struct map_window *mw) {
+    unmap_window(mw);
+    close(mw->fd);
+}
+
+// maps [offset, offset + len) clamped to the file, replacing the previous window
+bool map_range(struct map_window *mw, off_t offset, size_t len) {
+    static long page_size = 0;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    unmap_window(mw);
+    if (offset >= mw->file_size) {
+        return false;
+    }
+    if ((off_t) len > mw->file_size - offset) {
+        len = mw->file_size - offset;
+    }
+
+    off_t position = mw->origin + offset;
+    off_t aligned = position - position % page_size;
+    mw->base_len = len + (position - aligned);
+    mw->base = mmap(NULL, mw->base_len, PROT_READ, MAP_SHARED, mw->fd, aligned);
+    if (mw->base == MAP_FAILED) {
+        mw->base = NULL;
+        return false;
+    }
+    mw->data = mw->base + (position - aligned);
+    mw->len = len;
+    return true;
+}
+
+// Finds needle comparing its first and last byte against 16 positions of
+// the haystack at once; only positions where both match are memcmp'd.
+const unsigned char *find_bytes(const unsigned char *hay, size_t hay_len,
+                                const unsigned char *needle, size_t n) {
+    size_t i = 0;
+    if (n == 0 || hay_len < n) {
+        return NULL;
+    }
+
+#if defined(__SSE2__)
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= hay_len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (hay + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit, needle, n) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t first = vdupq_n_u8(needle[0]);
+    uint8x16_t last = vdupq_n_u8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= hay_len; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(hay + i), first), vceqq_u8(vld1q_u8(hay + i + n - 1), last));
+        // one nibble per byte position
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask) / 4;
+            if (memcmp(hay + i + bit, needle, n) == 0) {
+                return hay + i + bit;
+            }
+            mask &= ~(0xFULL << (bit * 4));
+        }
+    }
+#endif
+
+    for (; i + n <= hay_len; i++) {
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, n) == 0) {
+            return hay + i;
+        }
+    }
+    return NULL;
+}
+
+// Searches from offset to the end of the file a chunk at a time, chunks
+// overlapping by the pattern length so matches across them are found.
+off_t search_window(struct map_window *mw, off_t offset, const unsigned char *pattern, size_t n) {
+    off_t found = -1;
+
+    while (offset < mw->file_size && map_range(mw, offset, HEX_SEARCH_CHUNK)) {
+        madvise(mw->base, mw->base_len, MADV_SEQUENTIAL);
+        const unsigned char *hit = find_bytes(mw->data, mw->len, pattern, n);
+        if (hit) {
+            found = offset + (hit - mw->data);
+            break;
+        }
+        if (offset + (off_t) mw->len >= mw->file_size) {
+            break;
+        }
+        offset += mw->len - (n - 1);
+    }
+    unmap_window(mw);
+    return found;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// "de ad be ef" or "deadbeef" are bytes, anything else (or "quoted") is text
+size_t parse_pattern(const char *input, unsigned char *out, size_t max) {
+    size_t n = 0;
+    size_t len = strlen(input);
+
+    if (len >= 2 && input[0] == '"' && input[len - 1] == '"') {
+        n = len - 2 < max ? len - 2 : max;
+        memcpy(out, input + 1, n);
+        return n;
+    }
+
+    int high = -1;
+    for (size_t i = 0; i < len && n < max; i++) {
+        if (input[i] == ' ') {
+            continue;
+        }
+        int v = hex_value(input[i]);
+        if (v < 0) {
+            n = len < max ? len : max;
+            memcpy(out, input, n);
+            return n;
+        }
+        if (high < 0) {
+            high = v;
+        } else {
+            out[n++] = high << 4 | v;
+            high = -1;
+        }
+    }
+    if (high >= 0) {
+        n = len < max ? len : max;
+        memcpy(out, input, n);
+    }
+    return n;
+}
+
+int get_hex_bytes_per_row(int width) {
+    // offset, two spaces, "xx " per byte, a space and one char per byte
+    int bpr = 16;
+    while (bpr > 4 && 10 + 2 + bpr * 4 + 1 > width) {
+        bpr /= 2;
+    }
+    return bpr;
+}
+
+void print_hex_rows(struct map_window *mw, off_t offset, int row, int column, int rows,
+                    int bpr, off_t match, size_t match_len) {
+    if (!map_range(mw, offset, (size_t) rows * bpr)) {
+        return;
+    }
+
+    for (int r = 0; r < rows && (size_t) r * bpr < mw->len; r++) {
+        off_t row_offset = offset + (off_t) r * bpr;
+        const unsigned char *bytes = mw->data + (size_t) r * bpr;
+        size_t n = mw->len - (size_t) r * bpr < (size_t) bpr ? mw->len - (size_t) r * bpr : (size_t) bpr;
+
+        attron(COLOR_PAIR(6));
+        mvprintw(row + r, column, "%010llx", (unsigned long long) row_offset);
+        attroff(COLOR_PAIR(6));
+        printw("  ");
+        for (int i = 0; i < bpr; i++) {
+            off_t at = row_offset + i;
+            bool hit = match >= 0 && at >= match && at < match + (off_t) match_len;
+            if ((size_t) i >= n) {
+                printw("   ");
+                continue;
+            }
+            if (hit) attron(COLOR_PAIR(1));
+            printw("%02x", bytes[i]);
+            if (hit) attroff(COLOR_PAIR(1));
+            addch(' ');
+        }
+        addch(' ');
+        attron(COLOR_PAIR(7));
+        for (size_t i = 0; i < n; i++) {
+            addch(bytes[i] >= 0x20 && bytes[i] < 0x7f ? bytes[i] : '.');
+        }
+        attroff(COLOR_PAIR(7));
+    }
 }
 
-bool rename_file(char *current_name, char *new_name) {
-    struct stat st;
+// first rows of a binary file in the preview pane
+void print_hex_preview(struct map_window *mw, int row, int column, int rows, int width) {
+    print_hex_rows(mw, 0, row, column, rows, get_hex_bytes_per_row(width), -1, 0);
+    unmap_window(mw);
+}
 
-    char *current_path = get_new_path(wd.current_block->path, current_name);
-    char *new_path = get_new_path(wd.current_block->path, new_name);
+off_t parse_offset(const char *input, off_t file_size) {
+    char *end;
+    size_t len = strlen(input);
 
-    if (current_path == NULL) {
-        show_message_bottom_bar("Could not rename file: error finding current path");
-        return false;
+    if (len > 0 && input[len - 1] == '%') {
+        return (off_t) (strtod(input, NULL) / 100.0 * file_size);
+    }
+    if (strncmp(input, "0x", 2) == 0 || strncmp(input, "0X", 2) == 0) {
+        return strtoll(input + 2, &end, 16);
     }
+    return strtoll(input, &end, 10);
+}
 
-    if (new_path == NULL) {
-        show_message_bottom_bar("Could not rename file: error finding new path");
-        return false;
+// full screen hex viewer over an opened window
+void hex_viewer(struct map_window *mw, const char *title) {
+    unsigned char pattern[256];
+    size_t pattern_len = 0;
+    off_t match = -1;
+    off_t offset = 0;
+    int ch;
+
+    int bpr = get_hex_bytes_per_row(wd.term_width - 2);
+    int rows = wd.term_height - 3;
+    off_t last_row = mw->file_size > 0 ? (mw->file_size - 1) / bpr * bpr : 0;
+
+    while (1) {
+        clear();
+        attron(COLOR_PAIR(3));
+        mvprintw(0, 0, "%s", title);
+        attroff(COLOR_PAIR(3));
+        printw("  %lld bytes", (long long) mw->file_size);
+        print_hex_rows(mw, offset, 2, 1, rows, bpr, match, pattern_len);
+        attron(COLOR_PAIR(2));
+        mvprintw(wd.bottom_bar_row, 0, "g: go to offset  /: search  n: next  q: back");
+        attroff(COLOR_PAIR(2));
+        refresh();
+
+        ch = read_key();
+        if (ch == 'q' || ch == KEY_LEFT) {
+            break;
+        }
+
+        switch (ch) {
+            case KEY_UP:
+                offset -= bpr;
+                break;
+            case KEY_DOWN:
+                offset += bpr;
+                break;
+            case KEY_PPAGE:
+                offset -= (off_t) bpr * rows;
+                break;
+            case KEY_NPAGE:
+                offset += (off_t) bpr * rows;
+                break;
+            case KEY_HOME:
+                offset = 0;
+                break;
+            case KEY_END:
+                offset = last_row;
+                break;
+            case 'g':
+            {
+                char *input = read_input_bar("Offset (decimal, 0x hex or %): ");
+                if (input) {
+                    offset = parse_offset(input, mw->file_size) / bpr * bpr;
+                    free(input);
+                }
+                break;
+            }
+            case '/':
+            {
+                char *input = read_input_bar("Search (hex bytes or \"text\"): ");
+                if (input) {
+                    pattern_len = parse_pattern(input, pattern, sizeof(pattern));
+                    free(input);
+                    match = -1;
+                }
+            }
+            // fall through
+            case 'n':
+            {
+                if (pattern_len == 0) {
+                    break;
+                }
+                mvprintw(wd.bottom_bar_row, 0, "Searching...");
+                clrtoeol();
+                refresh();
+                off_t found = search_window(mw, match >= 0 ? match + 1 : offset, pattern, pattern_len);
+                if (found < 0) {
+                    show_message_bottom_bar("Pattern not found");
+                } else {
+                    match = found;
+                    offset = found / bpr * bpr;
+                }
+                break;
+            }
+        }
+
+        if (offset > last_row) {
+            offset = last_row;
+        }
+        if (offset < 0) {
+            offset = 0;
+        }
     }
 
-    if (stat(current_path, &st) != 0) {
-        if (errno == ENOENT) {
-            show_message_bottom_bar("Could not rename file: file does not exist!");
+}
+
+// Pager. The file is read through a map_window one screen at a time, and
+// a background thread builds a sparse index holding the offset of every
+// stride-th line. When the index fills up every other entry is dropped
+// and the stride doubles, so it never takes more than LINE_INDEX_MAX
+// offsets whatever the size of the file.
+
+#define LINE_INDEX_MAX    65536
+#define LINE_INDEX_CHUNK  (16 * 1024 * 1024)
+#define PAGER_SCAN        (1024 * 1024)
+#define PAGER_HSCROLL     8
+
+struct line_index
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    const char *path;
+    off_t *offsets;         // offsets[k] is where line k * stride starts
+    int n;
+    int64_t stride;
+    int64_t lines;          // newlines seen so far
+    off_t scanned;
+    off_t size;
+    bool done;
+    volatile bool cancel;
+};
+
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+#define MASK_BITS 4
+#else
+#define MASK_BITS 1
+#endif
+
+// newlines among the 16 bytes at p, MASK_BITS bits per byte
+static inline uint64_t get_newline_mask(const unsigned char *p) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), _mm_set1_epi8('\n')));
+#elif defined(__ARM_NEON)
+    uint8x16_t eq = vceqq_u8(vld1q_u8(p), vdupq_n_u8('\n'));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (uint64_t) (p[i] == '\n') << i;
+    }
+    return mask;
+#endif
+}
+
+// Records that line starts at offset, halving the index when it is full.
+// Readers take the lock, so the offsets only change under it.
+static void add_line_offset(struct line_index *li, int64_t line, off_t offset) {
+    pthread_mutex_lock(&li->lock);
+    if (li->n == LINE_INDEX_MAX) {
+        for (int k = 0; k < li->n / 2; k++) {
+            li->offsets[k] = li->offsets[2 * k];
+        }
+        li->n /= 2;
+        li->stride *= 2;
+    }
+    if (line % li->stride == 0) {
+        li->offsets[li->n++] = offset;
+    }
+    pthread_mutex_unlock(&li->lock);
+}
+
+// Counts the newlines of a mapped chunk 16 bytes at a time; only blocks
+// holding the newline that starts the next indexed line are walked bit
+// by bit. The count is published with the scanned offset afterwards.
+static void index_chunk(struct line_index *li, const unsigned char *data, size_t len, off_t base) {
+    size_t i = 0;
+    // only this thread changes stride and lines
+    int64_t lines = li->lines;
+    int64_t next = (lines / li->stride + 1) * li->stride;
+
+    for (; i + 16 <= len; i += 16) {
+        uint64_t mask = get_newline_mask(data + i);
+        int count = __builtin_popcountll(mask) / MASK_BITS;
+        if (lines + count < next) {
+            lines += count;
+            continue;
+        }
+        while (mask) {
+            int bit = __builtin_ctzll(mask) / MASK_BITS;
+            lines++;
+            if (lines == next) {
+                add_line_offset(li, lines, base + i + bit + 1);
+                next = (lines / li->stride + 1) * li->stride;
+            }
+            mask &= ~((((uint64_t) 1 << MASK_BITS) - 1) << (bit * MASK_BITS));
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] == '\n') {
+            lines++;
+            if (lines == next) {
+                add_line_offset(li, lines, base + i + 1);
+                next = (lines / li->stride + 1) * li->stride;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&li->lock);
+    li->lines = lines;
+    li->scanned = base + len;
+    pthread_mutex_unlock(&li->lock);
+}
+
+void *line_index_worker(void *arg) {
+    struct line_index *li = arg;
+    struct map_window mw;
+
+    set_low_priority();
+    if (!open_map_window(&mw, li->path)) {
+        pthread_mutex_lock(&li->lock);
+        li->done = true;
+        pthread_mutex_unlock(&li->lock);
+        return NULL;
+    }
+    for (off_t offset = 0; offset < li->size && !li->cancel; offset += LINE_INDEX_CHUNK) {
+        if (!map_range(&mw, offset, LINE_INDEX_CHUNK)) {
+            break;
+        }
+        index_chunk(li, mw.data, mw.len, offset);
+    }
+    close_map_window(&mw);
+    pthread_mutex_lock(&li->lock);
+    li->done = true;
+    pthread_mutex_unlock(&li->lock);
+    return NULL;
+}
+
+void start_line_index(struct line_index *li, const char *path, off_t size) {
+    memset(li, 0, sizeof(*li));
+    pthread_mutex_init(&li->lock, NULL);
+    li->path = path;
+    li->size = size;
+    li->stride = 1;
+    li->offsets = malloc(sizeof(off_t) * LINE_INDEX_MAX);
+    li->offsets[li->n++] = 0;
+    pthread_create(&li->thread, NULL, line_index_worker, li);
+}
+
+void stop_line_index(struct line_index *li) {
+    li->cancel = true;
+    pthread_join(li->thread, NULL);
+    pthread_mutex_destroy(&li->lock);
+    free(li->offsets);
+}
+
+// lines in the file once it has been indexed, -1 before
+int64_t get_total_lines(struct line_index *li, struct map_window *mw) {
+    pthread_mutex_lock(&li->lock);
+    int64_t total = li->done ? li->lines : -1;
+    pthread_mutex_unlock(&li->lock);
+    // a last line without a newline still counts
+    if (total >= 0 && li->size > 0 && map_range(mw, li->size - 1, 1) && mw->data[0] != '\n') {
+        total++;
+    }
+    return total;
+}
+
+// start of the line after the one starting at offset, -1 at the last line
+off_t get_next_line(struct map_window *mw, off_t offset) {
+    for (off_t at = offset; map_range(mw, at, PAGER_SCAN); at += mw->len) {
+        unsigned char *newline = memchr(mw->data, '\n', mw->len);
+        if (newline != NULL) {
+            off_t next = at + (newline - mw->data) + 1;
+            return next < mw->file_size ? next : -1;
+        }
+    }
+    return -1;
+}
+
+static unsigned char *find_last_newline(unsigned char *data, size_t len) {
+    while (len > 0) {
+        if (data[--len] == '\n') {
+            return data + len;
+        }
+    }
+    return NULL;
+}
+
+// start of the line before the one starting at offset, -1 at the first line
+off_t get_previous_line(struct map_window *mw, off_t offset) {
+    if (offset <= 0) {
+        return -1;
+    }
+    // skip the newline ending the previous line
+    off_t end = offset - 1;
+    while (end > 0) {
+        off_t at = end > PAGER_SCAN ? end - PAGER_SCAN : 0;
+        if (!map_range(mw, at, end - at)) {
+            return 0;
+        }
+        unsigned char *newline = find_last_newline(mw->data, mw->len);
+        if (newline != NULL) {
+            return at + (newline - mw->data) + 1;
+        }
+        end = at;
+    }
+    return 0;
+}
+
+// start of the line holding offset
+off_t get_line_start(struct map_window *mw, off_t offset) {
+    if (offset >= mw->file_size) {
+        offset = mw->file_size > 0 ? mw->file_size - 1 : 0;
+    }
+    off_t next = get_previous_line(mw, offset + 1);
+    return next < 0 ? 0 : next;
+}
+
+// Number of the line starting at offset: a binary search finds the last
+// indexed line before it and the newlines in between are counted. -1 when
+// the index has not got that far yet.
+int64_t get_line_number(struct line_index *li, struct map_window *mw, off_t offset) {
+    pthread_mutex_lock(&li->lock);
+    if (offset > li->scanned && !li->done) {
+        pthread_mutex_unlock(&li->lock);
+        return -1;
+    }
+    int low = 0, high = li->n - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (li->offsets[mid] <= offset) {
+            low = mid;
         } else {
-            show_message_bottom_bar("Could not rename file: error verifying file");
+            high = mid - 1;
         }
-        return false;
     }
+    int64_t line = low * li->stride;
+    off_t at = li->offsets[low];
+    pthread_mutex_unlock(&li->lock);
+
+    // count the newlines before offset a whole window at a time
+    while (at < offset && map_range(mw, at, offset - at < PAGER_SCAN ? offset - at : PAGER_SCAN)) {
+        unsigned char *p = mw->data, *end = mw->data + mw->len;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            line++;
+        }
+        at += mw->len;
+    }
+    return line;
+}
 
-    if (stat(new_path, &st) == 0) {
-        show_message_bottom_bar("Could not rename file: file already exist!");
-        return false;
+// Start of line, found from the closest indexed line before it. -1 when
+// the index has not reached it yet.
+off_t seek_line(struct line_index *li, struct map_window *mw, int64_t line) {
+    pthread_mutex_lock(&li->lock);
+    int64_t known = li->done ? INT64_MAX : li->lines;
+    int k = line / li->stride < li->n ? line / li->stride : li->n - 1;
+    int64_t at_line = k * li->stride;
+    off_t at = li->offsets[k];
+    pthread_mutex_unlock(&li->lock);
+
+    if (line > known) {
+        return -1;
     }
+    // step over newlines within each mapped window rather than remapping
+    // for every line; stops at the last line like get_next_line
+    for (off_t window = at; at_line < line && map_range(mw, window, PAGER_SCAN); window += mw->len) {
+        unsigned char *p = mw->data, *end = mw->data + mw->len;
+        while (at_line < line && (p = memchr(p, '\n', end - p)) != NULL) {
+            off_t next = window + (++p - mw->data);
+            if (next >= mw->file_size) {
+                return at;
+            }
+            at = next;
+            at_line++;
+        }
+    }
+    return at;
+}
 
-    if (rename(current_path, new_path) == 0) {
-        show_message_bottom_bar("File renamed!");
+// Draws a slice of a line lexed as language. Tabs are expanded within
+// the slice only, which is enough to keep columns straight on screen.
+static void print_pager_slice(int row, int column, const unsigned char *text, size_t len, int language, int width) {
+    struct span spans[MAX_SPANS];
+    struct preview_line pl;
+    int state = LEX_NORMAL;
+
+    pl.text = expand_line((const char *) text, len, &pl.len);
+    pl.n_spans = lex_line(language, pl.text, pl.len, &state, spans, MAX_SPANS);
+    pl.spans = spans;
+    print_preview_line(row, column, &pl, width);
+    free(pl.text);
+}
+
+// Draws the lines from top in the preview pane. Long lines are wrapped or
+// shown from byte hscroll on. Returns how many lines fit.
+int print_pager_page(struct map_window *mw, off_t top, int language, bool wrap, int hscroll,
+                     int row, int column, int rows, int width) {
+    int n_lines = 0;
+    off_t at = top;
+
+    for (int r = 0; r < rows; r++) {
+        mvprintw(row + r, column - 1, "%*s", width + 1, "");
+    }
+    for (int r = 0; r < rows && at >= 0 && at < mw->file_size; n_lines++) {
+        // a screen of bytes at most; the rest of a longer line is never shown
+        size_t want = wrap ? (size_t) width * (rows - r) : (size_t) hscroll + width;
+        if (!map_range(mw, at, want)) {
+            break;
+        }
+        unsigned char *newline = memchr(mw->data, '\n', mw->len);
+        size_t len = newline ? (size_t) (newline - mw->data) : mw->len;
+        if (wrap) {
+            size_t done = 0;
+            do {
+                size_t piece = len - done < (size_t) width ? len - done : (size_t) width;
+                print_pager_slice(row + r++, column, mw->data + done, piece, language, width);
+                done += piece;
+            } while (done < len && r < rows);
+        } else {
+            if ((size_t) hscroll < len) {
+                print_pager_slice(row + r, column, mw->data + hscroll, len - hscroll, language, width);
+            }
+            r++;
+        }
+        at = get_next_line(mw, at);
+    }
+    return n_lines;
+}
+
+// parses "1234" as a line and "50%" as a position in the file
+bool parse_pager_target(const char *input, off_t size, int64_t *line, off_t *offset) {
+    char *end;
+    size_t len = strlen(input);
+
+    *line = -1;
+    *offset = -1;
+    if (len > 0 && input[len - 1] == '%') {
+        double percent = strtod(input, &end);
+        if (end == input || percent < 0 || percent > 100) {
+            return false;
+        }
+        *offset = (off_t) (percent / 100.0 * size);
         return true;
-    } else {
-        show_message_bottom_bar("Error renaming file");
+    }
+    long long value = strtoll(input, &end, 10);
+    if (end == input || *end != '\0' || value < 1) {
         return false;
     }
-
+    *line = value - 1;
+    return true;
 }
 
-void rename_bar() {
+// Pages through path in the preview pane until q or escape.
+void pager(const char *path, int language) {
+    struct map_window mw;
+    struct line_index li;
+    off_t top = 0;
+    int64_t top_line = 0;       // -1 until the index reaches top
+    int hscroll = 0;
+    bool wrap = false;
     int ch;
-    char *new_name = malloc(wd.term_width * sizeof(char));
-    char message[] = "New name: ";
-    int message_len = strlen(message);
-    int column = message_len;
-    int i = 0;
 
-    while (1) {   
+    if (!open_map_window(&mw, path)) {
+        show_message_bottom_bar("Could not open file");
+        return;
+    }
+    start_line_index(&li, path, mw.file_size);
+
+    int column = (wd.block_quantity >= 2) ? get_column_by_index(1) : get_column_by_index(0);
+    int row = wd.box_row + 1;
+    int rows = (wd.bottom_bar_row - 1) - row;
+    int width = wd.term_width - column - 1;
+
+    while (1) {
+        if (top_line < 0) {
+            top_line = get_line_number(&li, &mw, top);
+        }
+        int shown = print_pager_page(&mw, top, language, wrap, hscroll, row, column, rows, width);
+        int64_t total = get_total_lines(&li, &mw);
+
         move(wd.bottom_bar_row, 0);
         clrtoeol();
         attron(COLOR_PAIR(2));
-        mvprintw(wd.bottom_bar_row, 0, "%s%s", message, new_name);
+        if (top_line >= 0) {
+            printw("Line %lld", (long long) top_line + 1);
+        } else {
+            printw("Line ?");
+        }
+        if (total >= 0) {
+            printw(" of %lld", (long long) total);
+        } else {
+            pthread_mutex_lock(&li.lock);
+            printw(" (indexing %d%%)", li.size > 0 ? (int) (li.scanned * 100 / li.size) : 100);
+            pthread_mutex_unlock(&li.lock);
+        }
+        printw("  %d%%  g: go to line or %%  w: %s  q: back", mw.file_size > 0 ? (int) (top * 100 / mw.file_size) : 100,
+               wrap ? "no wrap" : "wrap");
         attroff(COLOR_PAIR(2));
+        refresh();
 
-        ch = getch();
+        // redraw while the index grows so the status follows it
+        timeout(total < 0 ? 200 : -1);
+        ch = read_key();
+        timeout(-1);
+        if (ch == 'q' || ch == 27) {
+            break;
+        }
 
-        if (ch == KEY_BACKSPACE || ch == 127) {
-            if (column > message_len) {
-                i--;
-                new_name[i] = '\0';
-                column--;
-                mvaddch(wd.bottom_bar_row, column, ' ');
-                move(wd.bottom_bar_row, column);
-            } 
-            continue;
-        } else if (ch == KEY_ENTER || ch == K_ENTER) {
-            if (column > message_len) {
+        switch (ch) {
+            case KEY_DOWN:
+            {
+                off_t next = get_next_line(&mw, top);
+                if (next >= 0) {
+                    top = next;
+                    top_line = top_line >= 0 ? top_line + 1 : -1;
+                }
+                break;
+            }
+            case KEY_UP:
+            {
+                off_t previous = get_previous_line(&mw, top);
+                if (previous >= 0) {
+                    top = previous;
+                    top_line = top_line >= 0 ? top_line - 1 : -1;
+                }
+                break;
+            }
+            case KEY_NPAGE:
+            case ' ':
+                for (int i = 0; i < (shown > 1 ? shown - 1 : 1); i++) {
+                    off_t next = get_next_line(&mw, top);
+                    if (next < 0) {
+                        break;
+                    }
+                    top = next;
+                    top_line = top_line >= 0 ? top_line + 1 : -1;
+                }
+                break;
+            case KEY_PPAGE:
+                for (int i = 0; i < rows - 1; i++) {
+                    off_t previous = get_previous_line(&mw, top);
+                    if (previous < 0) {
+                        break;
+                    }
+                    top = previous;
+                    top_line = top_line >= 0 ? top_line - 1 : -1;
+                }
+                break;
+            case KEY_HOME:
+                top = 0;
+                top_line = 0;
+                break;
+            case KEY_END:
+                top = get_line_start(&mw, mw.file_size);
+                for (int i = 0; i < rows - 1; i++) {
+                    off_t previous = get_previous_line(&mw, top);
+                    if (previous < 0) {
+                        break;
+                    }
+                    top = previous;
+                }
+                top_line = -1;
+                break;
+            case KEY_RIGHT:
+                if (!wrap) {
+                    hscroll += PAGER_HSCROLL;
+                }
+                break;
+            case KEY_LEFT:
+                hscroll = hscroll > PAGER_HSCROLL ? hscroll - PAGER_HSCROLL : 0;
+                break;
+            case 'w':
+                wrap = !wrap;
+                hscroll = 0;
+                break;
+            case 'g':
+            {
+                int64_t line;
+                off_t offset;
+                char *input = read_input_bar("Go to line or %: ");
+                if (input == NULL) {
+                    break;
+                }
+                if (!parse_pager_target(input, mw.file_size, &line, &offset)) {
+                    show_message_bottom_bar("Not a line or a percentage");
+                } else if (offset >= 0) {
+                    top = get_line_start(&mw, offset);
+                    top_line = -1;
+                } else if ((offset = seek_line(&li, &mw, line)) < 0) {
+                    show_message_bottom_bar("That line has not been indexed yet");
+                } else {
+                    top = offset;
+                    top_line = -1;
+                }
+                free(input);
                 break;
-            } else {
-                show_message_bottom_bar("Filename cannot be empty");
-                continue;
             }
         }
+    }
 
-        attron(COLOR_PAIR(2));
-        mvaddch(wd.bottom_bar_row, column++, ch);
-        attroff(COLOR_PAIR(2));
-        new_name[i++] = ch;  
-        if (column >= wd.term_width - 1) {
+    stop_line_index(&li);
+    close_map_window(&mw);
+}
+
+// Follow mode functions. The ring holds the last FOLLOW_LINES lines;
+// after a burst only the last FOLLOW_TAIL_BYTES appended are read.
+
+static void add_follow_line(const char *text, size_t len) {
+    int out_len;
+    char *line = expand_line(text, len, &out_len);
+
+    if (fl.n_lines == FOLLOW_LINES) {
+        free(fl.lines[fl.head]);
+        fl.lines[fl.head] = line;
+        fl.head = (fl.head + 1) % FOLLOW_LINES;
+    } else {
+        fl.lines[(fl.head + fl.n_lines++) % FOLLOW_LINES] = line;
+    }
+}
+
+// splits data into lines, carrying the unfinished last one over
+static void add_follow_data(const char *data, size_t len) {
+    while (len > 0) {
+        const char *newline = memchr(data, '\n', len);
+        size_t piece = newline ? (size_t) (newline - data) : len;
+        // past PREVIEW_LINE_MAX nothing is shown, so nothing is kept
+        size_t room = PREVIEW_LINE_MAX - fl.partial_len;
+        size_t keep = piece < room ? piece : room;
+        memcpy(fl.partial + fl.partial_len, data, keep);
+        fl.partial_len += keep;
+        if (newline == NULL) {
+            return;
+        }
+        add_follow_line(fl.partial, fl.partial_len);
+        fl.partial_len = 0;
+        data += piece + 1;
+        len -= piece + 1;
+    }
+}
+
+static void clear_follow_lines(void) {
+    for (int i = 0; i < fl.n_lines; i++) {
+        free(fl.lines[(fl.head + i) % FOLLOW_LINES]);
+    }
+    fl.n_lines = 0;
+    fl.head = 0;
+    fl.partial_len = 0;
+}
+
+static void remove_follow_watch(void) {
+    if (fl.watch_id < 0) {
+        return;
+    }
+#if defined(__linux__)
+    inotify_rm_watch(ev.watch_fd, fl.watch_id);
+#else
+    close(fl.watch_id);
+#endif
+    fl.watch_id = -1;
+}
+
+static void add_follow_watch(void) {
+    if (ev.watch_fd < 0) {
+        return;
+    }
+#if defined(__linux__)
+    fl.watch_id = inotify_add_watch(ev.watch_fd, fl.path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+    struct kevent change;
+    fl.watch_id = open(fl.path, O_EVTONLY | O_CLOEXEC);
+    if (fl.watch_id >= 0) {
+        EV_SET(&change, fl.watch_id, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+        if (kevent(ev.watch_fd, &change, 1, NULL, 0, NULL) != 0) {
+            close(fl.watch_id);
+            fl.watch_id = -1;
+        }
+    }
+#endif
+}
+
+// Reads what was appended to the open file since fl.offset. When more
+// than FOLLOW_TAIL_BYTES arrived only their end is read, starting at a
+// line boundary. True when there was something.
+static bool read_appended(off_t size) {
+    static char buffer[FOLLOW_READ_CHUNK];
+    bool skipping = false;
+    ssize_t n;
+
+    if (size <= fl.offset) {
+        return false;
+    }
+    if (size - fl.offset > FOLLOW_TAIL_BYTES) {
+        clear_follow_lines();
+        fl.offset = size - FOLLOW_TAIL_BYTES;
+        skipping = true;
+    }
+    while (fl.offset < size) {
+        size_t want = size - fl.offset < FOLLOW_READ_CHUNK ? size - fl.offset : FOLLOW_READ_CHUNK;
+        if ((n = pread(fl.fd, buffer, want, fl.offset)) <= 0) {
             break;
         }
-    }
-
-    new_name[i] = '\0';
-
-    attron(COLOR_PAIR(2));
-    mvprintw(wd.bottom_bar_row, 0, "Rename file as %s? [y/n]", new_name);
-    attroff(COLOR_PAIR(2));
-    ch = getch();
-    if (ch == 'y' || ch == 'Y') {
-        if (rename_file(wd.current_block->selected, new_name)) {
-            *wd.current_block = get_dirblock(wd.current_block->path, wd.current_block->column);
-        } else {
-            show_message_bottom_bar("There was an error renaming the file");
+        fl.offset += n;
+        char *data = buffer;
+        if (skipping) {
+            // the line cut by the jump is dropped
+            char *newline = memchr(buffer, '\n', n);
+            if (newline == NULL) {
+                continue;
+            }
+            data = newline + 1;
+            skipping = false;
         }
-        free(new_name);
-    } else {
-        show_message_bottom_bar("File will not be renamed");
+        add_follow_data(data, n - (data - buffer));
     }
+    return true;
 }
 
-bool is_regular(char *path) {
-    struct stat path_stat;
+// opens fl.path and reads its tail
+static bool open_followed(void) {
+    struct stat st;
 
-    if (stat(path, &path_stat) != 0) {
-        // Error: file does not exist or cannot be accessed
+    fl.fd = open(fl.path, O_RDONLY | O_CLOEXEC);
+    if (fl.fd < 0 || fstat(fl.fd, &st) != 0) {
         return false;
     }
+    fl.dev = st.st_dev;
+    fl.ino = st.st_ino;
+    fl.offset = 0;
+    add_follow_watch();
+    read_appended(st.st_size);
+    return true;
+}
 
-    return S_ISREG(path_stat.st_mode);
+void stop_follow(void) {
+    if (fl.path == NULL) {
+        return;
+    }
+    remove_follow_watch();
+    if (fl.fd >= 0) {
+        close(fl.fd);
+    }
+    clear_follow_lines();
+    free(fl.partial);
+    free(fl.path);
+    free(fl.pattern);
+    memset(&fl, 0, sizeof(fl));
 }
 
-bool is_printable(char *path) {
-    if (!is_regular(path)) {
+bool start_follow(const char *path, int language) {
+    stop_follow();
+    fl.path = strdup(path);
+    fl.partial = malloc(PREVIEW_LINE_MAX);
+    fl.watch_id = -1;
+    fl.language = language;
+    if (!open_followed()) {
+        stop_follow();
         return false;
     }
+    return true;
+}
 
-    int n = sizeof(TEXT_FILE_EXTENSIONS) / sizeof(TEXT_FILE_EXTENSIONS[0]);
+// Catches up after the watch fired. A file truncated in place is read
+// again from the start; one replaced under the same name (logrotate) is
+// read to its end and then the new file is opened by path. True when
+// the tail changed.
+bool update_follow(void) {
+    struct stat st, current;
 
-    for (int i = 0; i < n; i++) {
-        if(strstr(path, TEXT_FILE_EXTENSIONS[i]) != NULL) {
-            return true;
+    if (fl.path == NULL || !fl.pending) {
+        return false;
+    }
+    fl.pending = false;
+    if (fstat(fl.fd, &st) != 0) {
+        return false;
+    }
+
+    bool changed = false;
+    if (st.st_size < fl.offset) {
+        fl.partial_len = 0;
+        add_follow_line("--- truncated ---", 17);
+        fl.offset = 0;
+        changed = true;
+    }
+    changed |= read_appended(st.st_size);
+
+    // the name may point somewhere else now, or nowhere until it is recreated
+    if (stat(fl.path, &current) == 0 && (current.st_dev != fl.dev || current.st_ino != fl.ino)) {
+        remove_follow_watch();
+        close(fl.fd);
+        fl.partial_len = 0;
+        add_follow_line("--- reopened ---", 16);
+        changed = true;
+        if (!open_followed()) {
+            stop_follow();
         }
     }
+    return changed;
+}
 
-    return false;
+// Puts the selection back on the followed file after its directory was
+// listed again; a rotated log briefly disappears and comes back.
+void select_followed(void) {
+    struct dirblock *block = wd.current_block;
+    if (fl.path == NULL) {
+        return;
+    }
+    for (int i = 0; i < block->n_files; i++) {
+        char *path = get_new_path(block->path, block->files[i].name);
+        bool found = equal_strings(path, fl.path);
+        free(path);
+        if (found) {
+            block->selected_index = i;
+            block->selected = block->files[i].name;
+            return;
+        }
+    }
 }
 
-void print_overview(char *path) {
+// draws text with every occurrence of fl.pattern highlighted
+static void print_follow_line(int row, int column, const char *text, int width) {
+    struct span spans[MAX_SPANS];
+    struct preview_line pl = {(char *) text, strlen(text), spans, 0};
+    int state = LEX_NORMAL;
 
-    if (!is_printable(path)) {
+    pl.n_spans = lex_line(fl.language, pl.text, pl.len, &state, spans, MAX_SPANS);
+    print_preview_line(row, column, &pl, width);
+    if (fl.pattern == NULL) {
         return;
     }
+    size_t pattern_len = strlen(fl.pattern);
+    for (const char *match = strstr(text, fl.pattern); match; match = strstr(match + pattern_len, fl.pattern)) {
+        // UTF-8 continuation bytes take no column
+        int at = 0;
+        for (const char *p = text; p < match; p++) {
+            at += (*p & 0xC0) != 0x80;
+        }
+        if (at >= width) {
+            break;
+        }
+        int len = 0;
+        for (size_t i = 0; i < pattern_len; i++) {
+            len += (match[i] & 0xC0) != 0x80;
+        }
+        mvchgat(row, column + at, at + len > width ? width - at : len, A_REVERSE | A_BOLD, 4, NULL);
+    }
+}
 
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
+// the tail of the followed file, newest line at the bottom
+void print_follow(int row, int column, int rows, int width) {
+    attron(COLOR_PAIR(2));
+    mvprintw(row, column, "Following, f to stop, / to highlight%s%s", fl.pattern ? ": " : "", fl.pattern ? fl.pattern : "");
+    attroff(COLOR_PAIR(2));
+
+    int n = fl.n_lines + (fl.partial_len > 0);
+    int shown = n < rows - 1 ? n : rows - 1;
+    for (int i = 0; i < shown; i++) {
+        int index = n - shown + i;
+        if (index < fl.n_lines) {
+            print_follow_line(row + 1 + i, column, fl.lines[(fl.head + index) % FOLLOW_LINES], width);
+        } else {
+            int len;
+            char *text = expand_line(fl.partial, fl.partial_len, &len);
+            print_follow_line(row + 1 + i, column, text, width);
+            free(text);
+        }
+    }
+}
+
+void print_overview(char *path) {
+    struct map_window mw;
+    struct preview *pv;
+    int member = get_selected_member(wd.current_block);
+
+    if (path == NULL) {
         return;
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
     int column = (wd.block_quantity >= 2) ? get_column_by_index(1) : get_column_by_index(0);
-    int quantity = 0;
     int max_width = (wd.term_width / 2) - 10;
+    int height = wd.term_height - 4;
 
-    do
-    {
-        if ((read = getline(&line, &len, fp)) == -1) {
+    if (fl.path != NULL && equal_strings(fl.path, path)) {
+        print_follow(wd.box_row + 1, column, height, wd.term_width - column - 1);
+        return;
+    }
+
+    // the renderer follows the class; text is the only one lexed
+    struct classification c;
+    if (member >= 0) {
+        c = classify_member(wd.current_block->archive, member);
+    } else {
+        c = classify_path(path);
+        // keeps the listing color in step when the file changes under us
+        wd.current_block->files[wd.current_block->selected_index].file_class = c.file_class;
+    }
+
+    switch (c.file_class) {
+        case CLASS_DIRECTORY:
+            if (member < 0) {
+                print_prefetched_listing(path, wd.box_row + 1, column, height, max_width);
+            }
+            return;
+        case CLASS_EMPTY:
+        case CLASS_OTHER:
+            return;
+        case CLASS_TEXT:
             break;
+        default:
+            if (member >= 0 ? open_member_window(&mw, wd.current_block->archive, member) : open_map_window(&mw, path)) {
+                print_hex_preview(&mw, wd.box_row + 1, column, height, wd.term_width - column - 2);
+                close_map_window(&mw);
+            }
+            return;
+    }
+
+    if (member >= 0) {
+        struct tar_index *tar = wd.current_block->archive;
+        pv = get_preview_of(path, tar->archive, tar->members[member].data_offset, tar->members[member].size, c.language);
+    } else {
+        pv = get_preview(path, c.language);
+    }
+
+    if (pv == NULL) {
+        return;
+    }
+
+    load_preview_window(pv, pv->scroll, height);
+    for (int i = 0; i < pv->n_lines; i++) {
+        print_preview_line(wd.box_row + 1 + i, column, &pv->lines[i], max_width);
+    }
+}
+
+// Draws the whole screen, or only the preview pane when nothing else
+// changed.
+void render(int dirty, char *selected_path) {
+    if ((dirty & DIRTY_ALL) == DIRTY_ALL) {
+        clear();
+        print_blocks(wd.blocks, wd.block_quantity);
+        print_bottom_bar(wd.current_block->selected, wd.current_block->path);
+        print_top_bar(wd.current_block->path, wd.current_block->selected);
+        print_borders(wd.blocks, wd.block_quantity, wd.box_row);
+    } else {
+        int column = (wd.block_quantity >= 2) ? get_column_by_index(1) : get_column_by_index(0);
+        for (int row = wd.box_row + 1; row < wd.bottom_bar_row - 1; row++) {
+            mvprintw(row, column - 1, "%*s", wd.term_width - column, "");
         }
-        mvaddnstr(wd.box_row + 1 + quantity, column, line, max_width);
-        quantity++;
-    } while (quantity < wd.term_height - 4);
-    
-    free(line);
-    fclose(fp);
+    }
+    print_overview(selected_path);
+    refresh();
+    bench_frame_done();
 }
 
 void start_loop()
@@ -915,19 +8347,63 @@ void start_loop()
     int ch;   
     char *file_to_copy;
     char *path_to_copy;
+    struct tar_index *archive_to_copy = NULL;
+    int member_to_copy = -1;
+    int dirty = DIRTY_ALL;
+    bool key_handled = false;
     while (1)
     {
-        clear(); // Limpiar pantalla
-        print_blocks(wd.blocks, wd.block_quantity);
-        print_bottom_bar(wd.current_block->selected, wd.current_block->path);
-        print_top_bar(wd.current_block->path, wd.current_block->selected);
-        print_borders(wd.blocks, wd.block_quantity, wd.box_row);
-        print_overview(get_new_path(wd.current_block->path, wd.current_block->selected));
-        refresh(); // Mostrarlo
+        char *selected_path = get_new_path(wd.current_block->path, wd.current_block->selected);
+        if (dirty) {
+            // following ends once the user moves the selection elsewhere
+            if (key_handled && fl.path != NULL && !equal_strings(fl.path, selected_path)) {
+                stop_follow();
+            }
+            // a replay draws nothing that depends on background timing
+            request_prefetch(is_virtual_block(wd.current_block) || bn.replaying ? NULL : selected_path);
+            sync_dir_watches();
+            render(dirty, selected_path);
+            dirty = 0;
+        }
 
-        ch = getch(); // Esperar tecla
-        if (ch == 'q')
+        // keys already typed go first, then sleep until something happens
+        ch = read_pending_key();
+        key_handled = ch != ERR;
+        if (ch == ERR) {
+            int events = wait_for_events();
+            free(selected_path);
+            if (events & EVENT_QUIT) {
+                break;
+            }
+            if (events & EVENT_RESIZE) {
+                handle_resize();
+                dirty |= DIRTY_ALL;
+            }
+            if (events & EVENT_WAKE) {
+                // a prefetched listing shows in the preview
+                dirty |= adopt_revalidated_blocks() ? DIRTY_ALL : DIRTY_PREVIEW;
+                if (adopt_relisted_blocks()) {
+                    select_followed();
+                    dirty |= DIRTY_ALL;
+                }
+                // directory marks filled in by a git rollup
+                if (__atomic_exchange_n(&git_rollup_published, false, __ATOMIC_ACQ_REL)) {
+                    dirty |= DIRTY_ALL;
+                }
+            }
+            if (events & EVENT_WATCH) {
+                queue_watched_blocks();
+            }
+            if ((events & EVENT_WATCH) && update_follow()) {
+                dirty |= DIRTY_PREVIEW;
+            }
+            continue;
+        }
+        dirty = DIRTY_ALL;
+        if (ch == 'q') {
+            free(selected_path);
             break; // Salir con 'q'
+        }
 
         switch (ch)
         {
@@ -942,12 +8418,29 @@ void start_loop()
             case KEY_LEFT:
                 delete_block();
                 break;
+            case KEY_NPAGE:
+                scroll_preview(selected_path, wd.term_height - 4);
+                break;
+            case KEY_PPAGE:
+                scroll_preview(selected_path, -(wd.term_height - 4));
+                break;
             case KEY_RIGHT:
             {
-                char *newpath = get_new_path(wd.current_block->path, wd.current_block->selected);
-                if (newpath != NULL) {
-                    if (is_directory(newpath)) {
+                if (wd.current_block->archive) {
+                    int member = get_selected_member(wd.current_block);
+                    if (member >= 0 && S_ISDIR(wd.current_block->archive->members[member].mode)) {
+                        add_archive_block(wd.current_block->archive, member);
+                    }
+                } else if (selected_path != NULL) {
+                    if (is_directory(selected_path)) {
                         add_block();
+                    } else if (is_tar_archive(selected_path)) {
+                        struct tar_index *tar = get_tar_index(selected_path);
+                        if (tar) {
+                            add_archive_block(tar, 0);
+                        } else {
+                            show_message_bottom_bar("Could not read archive");
+                        }
                     }
                 }
                 break;
@@ -957,71 +8450,484 @@ void start_loop()
                 delete_bar();
                 break;
             }
+            case 'x':
+            {
+                int member = get_selected_member(wd.current_block);
+                if (member >= 0 && S_ISREG(wd.current_block->archive->members[member].mode)) {
+                    struct map_window mw;
+                    if (open_member_window(&mw, wd.current_block->archive, member)) {
+                        hex_viewer(&mw, selected_path);
+                        close_map_window(&mw);
+                    }
+                } else if (selected_path != NULL && is_regular(selected_path)) {
+                    struct map_window mw;
+                    if (open_map_window(&mw, selected_path)) {
+                        hex_viewer(&mw, selected_path);
+                        close_map_window(&mw);
+                    } else {
+                        show_message_bottom_bar("Could not open file");
+                    }
+                }
+                break;
+            }
+            case 'f':
+            {
+                if (fl.path != NULL) {
+                    stop_follow();
+                    break;
+                }
+                if (is_virtual_block(wd.current_block) || selected_path == NULL || !is_regular(selected_path)) {
+                    break;
+                }
+                if (!start_follow(selected_path, classify_path(selected_path).language)) {
+                    show_message_bottom_bar("Could not open file");
+                }
+                break;
+            }
+            case '/':
+            {
+                if (fl.path == NULL) {
+                    break;
+                }
+                free(fl.pattern);
+                fl.pattern = read_input_bar("Highlight: ");
+                break;
+            }
+            case 'v':
+            {
+                if (get_selected_member(wd.current_block) >= 0 || selected_path == NULL || !is_regular(selected_path)) {
+                    break;
+                }
+                struct classification c = classify_path(selected_path);
+                if (c.file_class != CLASS_TEXT) {
+                    show_message_bottom_bar("Only text files can be paged, x opens the hex viewer");
+                    break;
+                }
+                pager(selected_path, c.language);
+                break;
+            }
             case 'r':
             {
+                if (is_virtual_block(wd.current_block)) {
+                    show_message_bottom_bar("Files cannot be renamed here");
+                    break;
+                }
                 rename_bar();
                 break;
             }
             case 'n':
             {
+                if (is_virtual_block(wd.current_block)) {
+                    show_message_bottom_bar("Files cannot be created here");
+                    break;
+                }
                 new_file_bar();
                 break;
             }
+            case ' ':
+            {
+                if (is_virtual_block(wd.current_block) || wd.current_block->n_files == 0) {
+                    break;
+                }
+                struct entry *e = &wd.current_block->files[wd.current_block->selected_index];
+                e->marked = !e->marked;
+                wd.current_block->selected = get_next_file(wd.current_block, wd.current_block->n_files);
+                wd.current_block->selected_index = wd.current_block->selected_index == (wd.current_block->n_files) - 1 ? 0 : wd.current_block->selected_index + 1;
+                break;
+            }
+            case 'R':
+            {
+                if (is_virtual_block(wd.current_block)) {
+                    show_message_bottom_bar("Files cannot be renamed here");
+                    break;
+                }
+                bulk_rename_bar();
+                break;
+            }
+            case 'u':
+            {
+                undo_bar();
+                break;
+            }
+            case 'D':
+            {
+                if (is_virtual_block(wd.current_block)) {
+                    show_message_bottom_bar("Duplicates can only be searched in directories");
+                    break;
+                }
+                find_duplicates();
+                break;
+            }
+            case 'c':
+            case 'C':
+            {
+                // the first press picks the source, the second the target
+                if (is_virtual_block(wd.current_block) || selected_path == NULL || !is_directory(selected_path)) {
+                    show_message_bottom_bar("Only directories can be compared");
+                    break;
+                }
+                if (wd.compare_source == NULL) {
+                    wd.compare_source = strdup(selected_path);
+                } else if (equal_strings(wd.compare_source, selected_path)) {
+                    free(wd.compare_source);
+                    wd.compare_source = NULL;
+                } else {
+                    char *source = wd.compare_source;
+                    wd.compare_source = NULL;
+                    compare_bar(source, selected_path, ch == 'C');
+                    free(source);
+                }
+                break;
+            }
+            case 'S':
+            {
+                if (!wd.current_block->comparison) {
+                    show_message_bottom_bar("Sync works on a comparison");
+                    break;
+                }
+                sync_bar();
+                break;
+            }
             case 'm':
             {
                 if (!wd.moving_file) {
                     path_to_copy = strdup(wd.current_block->path);
                     file_to_copy = strdup(wd.current_block->selected);
-                    char *path = get_new_path(wd.current_block->path, wd.current_block->selected);
+                    // members can only be copied out of the archive
+                    archive_to_copy = wd.current_block->archive;
+                    member_to_copy = get_selected_member(wd.current_block);
+                    if (archive_to_copy) {
+                        archive_to_copy->refs++;
+                    }
                     wd.moving_file = true;
                 } else {
                     wd.moving_file = false;
                 }
+                if (!wd.moving_file && archive_to_copy) {
+                    release_tar_index(archive_to_copy);
+                    archive_to_copy = NULL;
+                }
                 break;
             }
             case K_ENTER:
             {
                 if (wd.moving_file) {
+                    if (is_virtual_block(wd.current_block)) {
+                        show_message_bottom_bar("Files can only be moved into directories");
+                        break;
+                    }
                     char *src = get_new_path(path_to_copy, file_to_copy);
                     char *dst = get_new_path(wd.current_block->path, file_to_copy);
                     if (src == NULL || dst == NULL) {
                         break;
                     }
-                    if (copy_file(src, dst)) {
+                    if (archive_to_copy) {
+                        if (member_to_copy < 0 || !S_ISREG(archive_to_copy->members[member_to_copy].mode)) {
+                            show_message_bottom_bar("Only files can be copied out of an archive");
+                        } else if (extract_tar_member(archive_to_copy, member_to_copy, dst)) {
+                            wd.moving_file = false;
+                            release_tar_index(archive_to_copy);
+                            archive_to_copy = NULL;
+                            refresh_blocks_in(wd.current_block->path);
+                            show_message_bottom_bar("File copied out of the archive");
+                        } else {
+                            show_message_bottom_bar("Error copying file out of the archive");
+                        }
+                    } else if (move_path(src, dst)) {
+                        char *absolute_src = absolute_path(src);
+                        char *absolute_dst = absolute_path(dst);
+                        if (absolute_src != NULL && absolute_dst != NULL) {
+                            journal_append("move", absolute_src, absolute_dst);
+                        }
+                        free(absolute_src);
+                        free(absolute_dst);
                         wd.moving_file = false;
-                        *wd.current_block = get_dirblock(wd.current_block->path, wd.current_block->column);
+                        refresh_blocks_in(path_to_copy);
+                        refresh_blocks_in(wd.current_block->path);
                         show_message_bottom_bar("File moved successfully");
+                    } else if (errno == EEXIST) {
+                        show_message_bottom_bar("Could not move: file already exists");
+                    } else {
+                        show_message_bottom_bar("Error moving file");
                     }
+                    free(src);
+                    free(dst);
                 }
                 break;
             }
         }
+        free(selected_path);
     }
 
+    save_session();
     endwin();
 }
 
+// Synthetic tree for replays, the same on every run: BENCH_DIRS
+// directories of BENCH_FILES files of every class, with fixed contents,
+// names and mtimes.
+
+#define BENCH_DIRS      24
+#define BENCH_FILES     60
+#define BENCH_MTIME     1577836800  // 2020-01-01
+
+static uint64_t bench_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void write_bench_file(const char *path, int kind, uint64_t *state) {
+    static const char *WORDS[] = {"int", "return", "value", "struct", "for", "if", "size", "char", "while", "node"};
+    static const unsigned char PNG[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return;
+    }
+    int size = 64 + bench_random(state) % 8192;
+    switch (kind) {
+        case 0: // text
+            for (int written = 0; written < size; ) {
+                written += fprintf(file, "%s %s = %d;\n", WORDS[bench_random(state) % 10],
+                                   WORDS[bench_random(state) % 10], (int) (bench_random(state) % 1000));
+            }
+            break;
+        case 1: // script
+            fprintf(file, "#!/bin/sh\n");
+            for (int i = 0; i < size / 32; i++) {
+                fprintf(file, "echo \"%s %d\"\n", WORDS[bench_random(state) % 10], i);
+            }
+            break;
+        case 2: // image
+            fwrite(PNG, 1, sizeof(PNG), file);
+            // fall through
+        case 3: // binary
+            for (int i = 0; i < size; i++) {
+                fputc(bench_random(state) & 0xff, file);
+            }
+            break;
+        default: // empty
+            break;
+    }
+    fclose(file);
+}
+
+static void set_bench_mtime(const char *path) {
+    struct timespec times[2] = {{BENCH_MTIME, 0}, {BENCH_MTIME, 0}};
+    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+// builds the tree under root, returning false when it could not
+bool make_bench_tree(const char *root) {
+    static const char *EXTENSIONS[] = {"c", "sh", "png", "bin", "txt"};
+    uint64_t state = 0x9e3779b97f4a7c15;
+    char path[PATH_MAX];
+
+    if (mkdir(root, 0755) != 0) {
+        return false;
+    }
+    for (int d = 0; d < BENCH_DIRS; d++) {
+        snprintf(path, PATH_MAX, "%s/dir-%02d", root, d);
+        mkdir(path, 0755);
+        snprintf(path, PATH_MAX, "%s/dir-%02d/nested", root, d);
+        mkdir(path, 0755);
+        for (int f = 0; f < BENCH_FILES; f++) {
+            int kind = f % 5;
+            snprintf(path, PATH_MAX, "%s/dir-%02d/%sfile-%03d.%s", root, d, f % 7 == 0 ? "nested/" : "", f, EXTENSIONS[kind]);
+            write_bench_file(path, kind, &state);
+            if (kind == 1) {
+                chmod(path, 0755);
+            }
+            set_bench_mtime(path);
+        }
+        snprintf(path, PATH_MAX, "%s/dir-%02d/nested", root, d);
+        set_bench_mtime(path);
+        snprintf(path, PATH_MAX, "%s/dir-%02d", root, d);
+        set_bench_mtime(path);
+    }
+    for (int f = 0; f < BENCH_FILES; f++) {
+        snprintf(path, PATH_MAX, "%s/top-%03d.%s", root, f, EXTENSIONS[f % 5]);
+        write_bench_file(path, f % 5, &state);
+        set_bench_mtime(path);
+    }
+    set_bench_mtime(root);
+    return true;
+}
+
+// reads the keys of a recording, false when there are none
+bool load_replay(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[64];
+    long long ms;
+    int key;
+
+    if (file == NULL) {
+        return false;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] != '#' && sscanf(line, "%lld %d", &ms, &key) == 2) {
+            bn.keys = realloc(bn.keys, sizeof(int) * (bn.n_keys + 1));
+            bn.keys[bn.n_keys++] = key;
+        }
+    }
+    fclose(file);
+    return bn.n_keys > 0;
+}
+
+// counts what the terminal would have to draw
+static void *drain_terminal(void *arg) {
+    char buffer[65536];
+    ssize_t n;
+
+    while ((n = read(bn.master_fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            bn.bytes += n;
+        }
+    }
+    return NULL;
+}
+
+// Opens a pseudo-terminal of BENCH_COLS by BENCH_ROWS and starts ncurses
+// on it, so the frames are drawn the same whatever terminal runs the
+// replay.
+bool start_bench_terminal(void) {
+    struct winsize size = {BENCH_ROWS, BENCH_COLS, 0, 0};
+    char rows[16], cols[16];
+
+    bn.master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (bn.master_fd < 0 || grantpt(bn.master_fd) != 0 || unlockpt(bn.master_fd) != 0) {
+        return false;
+    }
+    int slave_fd = open(ptsname(bn.master_fd), O_RDWR | O_NOCTTY);
+    if (slave_fd < 0) {
+        return false;
+    }
+    ioctl(slave_fd, TIOCSWINSZ, &size);
+    bn.terminal = fdopen(slave_fd, "r+");
+    pthread_create(&bn.drain_thread, NULL, drain_terminal, NULL);
+
+    snprintf(rows, sizeof(rows), "%d", BENCH_ROWS);
+    snprintf(cols, sizeof(cols), "%d", BENCH_COLS);
+    setenv("LINES", rows, 1);
+    setenv("COLUMNS", cols, 1);
+    bn.screen = newterm("xterm-256color", bn.terminal, bn.terminal);
+    return bn.screen != NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank
+static double get_percentile_ms(int percent) {
+    int rank = (bn.n_latencies * percent + 99) / 100;
+    return bn.latencies[rank > 0 ? rank - 1 : 0] / 1e6;
+}
+
+void print_bench_report(void) {
+    if (bn.n_latencies == 0) {
+        printf("No frames drawn\n");
+        return;
+    }
+    qsort(bn.latencies, bn.n_latencies, sizeof(int64_t), compare_latency);
+    printf("Replayed %d keys, %d frames on %dx%d in %.1f ms\n", bn.n_keys, bn.n_latencies, BENCH_COLS, BENCH_ROWS,
+           (get_monotonic_ns() - bn.start) / 1e6);
+    printf("Key to frame: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms\n",
+           get_percentile_ms(50), get_percentile_ms(95), get_percentile_ms(99));
+    printf("Bytes written: %lld\n", (long long) bn.bytes);
+}
+
+// Sets up a replay in a fresh tree under the temporary directory, with its
+// own state and trash. Returns the tree to open, NULL on failure.
+char *start_replay(const char *keys_path) {
+    char root[PATH_MAX - 16], tree[PATH_MAX], state[PATH_MAX];
+    const char *tmp = getenv("TMPDIR");
+
+    if (!load_replay(keys_path)) {
+        fprintf(stderr, "No keys to replay in %s\n", keys_path);
+        return NULL;
+    }
+    snprintf(root, sizeof(root), "%s/mordred-bench-%d", tmp ? tmp : "/tmp", (int) getuid());
+    remove_tree(root);
+    snprintf(tree, PATH_MAX, "%s/tree", root);
+    snprintf(state, PATH_MAX, "%s/state", root);
+    if (mkdir(root, 0700) != 0 || !make_bench_tree(tree)) {
+        fprintf(stderr, "Could not create %s\n", root);
+        return NULL;
+    }
+    setenv("XDG_STATE_HOME", state, 1);
+    setenv("XDG_DATA_HOME", state, 1);
+    if (!start_bench_terminal()) {
+        fprintf(stderr, "Could not open a terminal to replay on\n");
+        return NULL;
+    }
+    bn.replaying = true;
+    return strdup(tree);
+}
+
+// closes the replay terminal once every byte has been counted
+void finish_replay(void) {
+    delscreen(bn.screen);
+    fclose(bn.terminal);
+    pthread_join(bn.drain_thread, NULL);
+    close(bn.master_fd);
+    print_bench_report();
+}
+
 int main(int argc, char *argv[])
 {
-    char *path;
+    char *path = ".";
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    int trash_max_age = 0;
+    int64_t trash_max_size = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (equal_strings(argv[i], "--record") && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (equal_strings(argv[i], "--replay") && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (equal_strings(argv[i], "--trash-max-age") && i + 1 < argc) {
+            trash_max_age = atoi(argv[++i]);
+        } else if (equal_strings(argv[i], "--trash-max-size") && i + 1 < argc) {
+            trash_max_size = atoll(argv[++i]) * 1024 * 1024;
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc > 1)
-    {
-        path = argv[argc - 1];
+    setlocale(LC_ALL, "");
+    if (replay_path != NULL && (path = start_replay(replay_path)) == NULL) {
+        return EXIT_FAILURE;
     }
-    else
-    {
-        path = ".";
+    if (record_path != NULL) {
+        bn.record = fopen(record_path, "w");
+        if (bn.record == NULL) {
+            fprintf(stderr, "Could not open %s\n", record_path);
+            return EXIT_FAILURE;
+        }
+        setvbuf(bn.record, NULL, _IOLBF, 0);
+        fprintf(bn.record, "# mordred keys: milliseconds key\n");
     }
-
+    start_events();
     start_ncurses();
     start_window(path);
+    start_purger(trash_max_age, trash_max_size);
     if (wd.term_width < 32) {
         printf("Terminal should should have a width greater of equal than 32\n");
         return EXIT_FAILURE;
     }
+    bn.start = get_monotonic_ns();
     start_loop();
 
+    if (bn.record != NULL) {
+        fclose(bn.record);
+    }
+    if (bn.replaying) {
+        finish_replay();
+    }
     // Terminar ncurses
     return 0;
 }